@@ -19,6 +19,40 @@
   statefulness and retrieving all data is done here.
 ****************************************************/
 
+/* per packet scheduler state */
+typedef struct _sched_state {
+  float period;       /* target interval in ms, 0 to schedule by frequency */
+  double deadline;    /* next deadline, in ms since acq start */
+  int freq_counter;   /* rounds since last fetch, for frequency mode */
+  timespec_t lastfetch; /* time of the last good fetch */
+  int fetched;        /* set after the first good fetch */
+} sched_state_t;
+
+/* local functions -----*/
+
+/* select the packets due this round, earliest deadline first, into order.
+   returns the number due.  if none are, *wait is set to the ms until the
+   earliest deadline. */
+int sched_select(aldl_commdef_t *comm, sched_state_t *sched, int *order,
+                 double now, double *wait);
+
+/* send the next queued aux command, if there is one, and complete it.
+   returns 1 if a command was sent. */
+int acq_command(aldl_conf_t *aldl, int retries);
+
+/* a packet was fetched, advance its deadline and update its stats */
+void sched_fetched(sched_state_t *s, aldl_sched_t *st, double now);
+
+#ifdef ADAPTIVE_TIMEOUT
+/* learn from the measured timing of a good reply, and set new deadlines */
+void timing_learn(aldl_timing_t *t, int length);
+
+/* a reply of length bytes timed out, back off the learned deadlines */
+void timing_backoff(aldl_timing_t *t, int length);
+#endif
+
+/************ FUNCTIONS **********************/
+
 void *aldl_acq(void *aldl_in) {
   #ifdef VERBLOSITY
   printf("aldl_acq thread active\n");
@@ -28,12 +62,19 @@ void *aldl_acq(void *aldl_in) {
   aldl_conf_t *aldl = (aldl_conf_t *)aldl_in;
   aldl_commdef_t *comm = aldl->comm; /* direct reference to commdef */
   aldl_packetdef_t *pkt = NULL; /* temporary pointer to the packet def */
-  aldl_comq_t *auxcommand = NULL;
+  #ifdef AUXCOMMAND_RETRY
+  int auxretries = AUXCOMMAND_RETRY; /* resends if the reply is bad */
+  #else
+  int auxretries = 0;
+  #endif
   int pktfail = 0; /* marker for a failed packet in event loop */
+  int badframe = 0; /* marker for a packet that arrived but was bad */
+  int repeat = -1; /* packet is the same as the last accepted, -1 unknown */
   int npkt = 0; /* array index of packet to operate on */
   int buffered = 0;
   int serialdowntime = 0;
-  aldl->ready = 0;
+  aldl_state_event_t stateevent; /* scratch for waiting out a pause */
+  set_ready(aldl,0);
 
   /* sanity checks */
   if(aldl->rate > 200000) error(1,ERROR_TIMING,
@@ -45,14 +86,32 @@ void *aldl_acq(void *aldl_in) {
   timespec_t lagtime;
   #endif
 
-  /* prepare array for packet retrieval frequency tracking */
-  int *freq_counter = smalloc(sizeof(int) * comm->n_packets);
-  int freq_init;
-  for(freq_init=0;freq_init < comm->n_packets; freq_init++) {
+  /* prepare scheduler state.  each packet has a period from MAXAGE or RATE,
+     and those without one fall back to being fetched every FREQUENCY
+     rounds. */
+  sched_state_t *sched = smalloc(sizeof(sched_state_t) * comm->n_packets);
+  int *order = smalloc(sizeof(int) * comm->n_packets); /* due this round */
+  int n_due = 0; /* packets due this round */
+  int due = 0; /* index into order */
+  double wait = 0; /* ms to wait when nothing is due */
+  for(npkt=0;npkt < comm->n_packets; npkt++) {
+    pkt = &comm->packet[npkt];
+    memset(&sched[npkt],0,sizeof(sched_state_t));
+    if(pkt->maxage > 0) {
+      sched[npkt].period = pkt->maxage;
+    } else if(pkt->rate > 0) {
+      sched[npkt].period = 1000 / pkt->rate;
+    }
     /* if we init the frequency with freq max, that will ensure that each
        packet is iterated once at the beginning of the acq. routine */
-    freq_counter[freq_init] = comm->packet[freq_init].frequency;
+    sched[npkt].freq_counter = pkt->frequency;
+    aldl->stats->sched[npkt].period = sched[npkt].period;
   }
+  timespec_t acqstart = get_time(); /* time base for deadlines */
+
+  /* working copy of the learned timing model, published to stats */
+  aldl_timing_t *timing = smalloc(sizeof(aldl_timing_t) * comm->n_packets);
+  memset(timing,0,sizeof(aldl_timing_t) * comm->n_packets);
 
   /* set timestamp */
   aldl->uptime = time(NULL);
@@ -61,6 +120,17 @@ void *aldl_acq(void *aldl_in) {
   #ifdef TRACK_PKTRATE
   timespec_t timestamp = get_time();
   int pktcounter = 0; /* how many packets between timestamps */
+  unsigned long wakeupstamp = aldl_get_wakeups(); /* wakeups at timestamp */
+  #endif
+
+  /* histogram sampling */
+  #ifdef STATS_HISTOGRAMS
+  timespec_t requeststamp; /* when the current request was sent */
+  timespec_t bytestamp = get_time(); /* start of the byte rate sample */
+  timespec_t recordstamp = get_time(); /* when the last record was linked */
+  unsigned long bytecounter = 0; /* good reply bytes since bytestamp */
+  int retries = 0; /* retries of the current packet */
+  unsigned long elapsed;
   #endif
 
   /* intial connection state */
@@ -69,29 +139,37 @@ void *aldl_acq(void *aldl_in) {
   /* loop infinitely until ALDL_QUIT is set */
   while(get_connstate(aldl) != ALDL_QUIT) {
 
-    /* iterate through all packets */
-    for(npkt=0;npkt < comm->n_packets;npkt++) {
-
-    /* ---- frequency select routine ---- */
-    /* skip packet if frequency is 0 to match spec */
-    if(comm->packet[npkt].frequency == 0) continue;
-    if(freq_counter[npkt] < comm->packet[npkt].frequency) {
-      /* frequency requirement not met */
-      freq_counter[npkt]++;
-      continue; /* go to next pkt */
-    } else {
-      /* reached frequency, reset to 1 */
-      freq_counter[npkt] = 1;
+    /* select this round's packets by earliest deadline.  if nothing is due
+       yet, send any waiting command in the gap, then sleep until something
+       is, in slices short enough that commands, pause and quit don't wait
+       on a long period.  a wait of 0 is a frequency round and goes on. */
+    n_due = sched_select(comm,sched,order,
+                         (double)get_elapsed_us(acqstart) / 1000,&wait);
+    if(n_due == 0) {
+      if(get_connstate(aldl) == ALDL_CONNECTED &&
+         acq_command(aldl,auxretries) == 1) continue;
+      if(wait < 0 || wait > ACQ_IDLE_SLICE) wait = ACQ_IDLE_SLICE;
+      if(wait > 0) usleep(wait * 1000);
+      continue;
     }
 
+    /* iterate through due packets */
+    for(due=0;due < n_due;due++) {
+
+    npkt = order[due];
+
     pkt = &comm->packet[npkt]; /* pointer to the correct packet */
 
     /* this is a jump point for packet retry that skils the for loop and
        packet selector */
     PKTRETRY:
+    repeat = -1;
 
     /* handle pause condition */
-    while(get_connstate(aldl) == ALDL_PAUSE) msleep(250);
+    while(get_connstate(aldl) == ALDL_PAUSE) {
+      wait_state_event(aldl,get_state_event(aldl,&stateevent),
+                       &stateevent,250);
+    }
 
     /* handle serial error */
     if(serial_get_status() != 1) {
@@ -113,9 +191,11 @@ void *aldl_acq(void *aldl_in) {
        drops, or if it never existed ... if not, time for a delay */
     if(get_connstate(aldl) >= 10) { /* if in any sort of disconnected state */
       aldl_reconnect(comm); /* main connection happens here */
+      /* the ecm may not be the one that was learned, start over */
+      memset(timing,0,sizeof(aldl_timing_t) * comm->n_packets);
       set_connstate(ALDL_CONNECTED,aldl);
     #ifndef AGGRESSIVE
-    } else {
+    } else if(aldl->rate > 0) {
       /* delay between data collection iterations */
       usleep(aldl->rate);
     #endif
@@ -131,14 +211,31 @@ void *aldl_acq(void *aldl_in) {
        statistical purposes */
     #ifdef TRACK_PKTRATE
     if(get_elapsed_ms(timestamp) >= PKTRATE_DURATION * 1000) {
-      lock_stats();
+      stats_write_begin(aldl);
       aldl->stats->packetspersecond = (float)pktcounter / PKTRATE_DURATION;
-      unlock_stats();
+      if(pktcounter > 0) {
+        aldl->stats->wakeupsperpacket = (float)(aldl_get_wakeups() -
+                                         wakeupstamp) / pktcounter;
+      }
+      stats_write_end(aldl);
+      wakeupstamp = aldl_get_wakeups();
       timestamp = get_time();
       pktcounter = 0;
     }
     #endif
 
+    /* sample the byte rate about once a second */
+    #ifdef STATS_HISTOGRAMS
+    elapsed = get_elapsed_ms(bytestamp);
+    if(elapsed >= 1000) {
+      stats_write_begin(aldl);
+      aldl_hist_add(&aldl->stats->byterate,(float)bytecounter * 1000 / elapsed);
+      stats_write_end(aldl);
+      bytecounter = 0;
+      bytestamp = get_time();
+    }
+    #endif
+
     /* print debugging info */
     #ifdef VERBLOSITY
     printf("ACQUIRE pkt# %i, total %i\n",npkt,ttlpkts);
@@ -147,30 +244,22 @@ void *aldl_acq(void *aldl_in) {
 
     /* ------- command insertion routine -------------------- */
 
-    auxcommand = aldl_get_command();
-    if(auxcommand != NULL) { /* a command was found */
-      serial_write(auxcommand->command, auxcommand->length); 
-      #ifdef AUXCOMMAND_RETRY
-      /* since aux commands are stateless, optional resend ... */
-      serial_write(auxcommand->command, auxcommand->length);
-      serial_write(auxcommand->command, auxcommand->length);
-      #endif
-      msleep(auxcommand->delay);
-      serial_purge(); /* flush after delay to discard? */
-      /* FIXME need more logic, maybe callbacks? */
-      free(auxcommand->command);
-      free(auxcommand);
-      goto noquerypkt; 
-    }
+    if(acq_command(aldl,auxretries) == 1) goto noquerypkt;
 
     /* ------- sanity checks and retrieve packet ------------ */
 
     /* send request and get packet data (from aldlcomm.c); if NULL is
        returned, it's because it timed out waiting for data. */
-    if(aldl_get_packet(pkt) == NULL) {
-      lock_stats();
+    #ifdef STATS_HISTOGRAMS
+    requeststamp = get_time();
+    #endif
+    if(aldl_get_packet(pkt,&timing[npkt]) == NULL) {
+      #ifdef ADAPTIVE_TIMEOUT
+      timing_backoff(&timing[npkt],pkt->length);
+      #endif
+      stats_write_begin(aldl);
       aldl->stats->packetrecvtimeout++;
-      unlock_stats();
+      stats_write_end(aldl);
       pktfail = 1;
       #ifdef VERBLOSITY
       printf("packet %i failed due to timeout...\n",npkt);
@@ -183,9 +272,10 @@ void *aldl_acq(void *aldl_in) {
     } else if (pkt->data[0] != comm->pcm_address ||
        pkt->data[1] != calc_msglength(pkt->length)) {
       pktfail = 1;
-      lock_stats();
+      badframe = 1;
+      stats_write_begin(aldl);
       aldl->stats->packetheaderfail++;
-      unlock_stats();
+      stats_write_end(aldl);
       #ifdef VERBLOSITY
       printf("header failed @ pkt %i...\n",npkt);
       #endif
@@ -193,31 +283,53 @@ void *aldl_acq(void *aldl_in) {
 
     /* verify checksum if that option is enabled in the commdef. */
     } else if(comm->checksum_enable == 1 &&
-       checksum_test(pkt->data, pkt->length) == 0) {
+       checksum_test_same(pkt->data,pkt->prev,pkt->length,&repeat) == 0) {
       pktfail = 1;
-      lock_stats();
+      badframe = 1;
+      stats_write_begin(aldl);
       aldl->stats->packetchecksumfail++;
-      unlock_stats();
+      stats_write_end(aldl);
       #ifdef VERBLOSITY
       printf("checksum failed @ pkt %i...\n",npkt);
       #endif
     }
 
+    /* a bad frame is often just misaligned in the stream.  try to recover it
+       in place before paying for a purge and a new request. */
+    #ifdef FRAME_RESYNC
+    if(badframe == 1 &&
+       aldl_resync_packet(pkt,comm,timing[npkt].reply_timeout) != NULL) {
+      pktfail = 0;
+      repeat = -1; /* the bytes moved */
+      stats_write_begin(aldl);
+      aldl->stats->packetresync++;
+      stats_write_end(aldl);
+      #ifdef VERBLOSITY
+      printf("resync recovered pkt %i...\n",npkt);
+      #endif
+    }
+    #endif
+    badframe = 0;
+
     /* handle condition of a bad packet */
     if(pktfail == 1) {
-      lock_stats();
+      stats_write_begin(aldl);
       aldl->stats->failcounter++; /* increment failed pkt counter */
       #ifdef VERBLOSITY
       printf("packet fail counter: %i\n",aldl->stats->failcounter);
       #endif
 
+      stats_write_end(aldl);
+
       /* --- set a desync state if we're getting lots of fails in a row */
       if(aldl->stats->failcounter > aldl->maxfail) {
         set_connstate(ALDL_DESYNC,aldl);
       }
-      unlock_stats();
 
       pktfail = 0; /* reset fail state */
+      #ifdef STATS_HISTOGRAMS
+      retries++;
+      #endif
       goto PKTRETRY; /* jump back to earlier in the loop, no increment */
 
     /* packet is good to go */
@@ -225,9 +337,44 @@ void *aldl_acq(void *aldl_in) {
       #ifdef TRACK_PKTRATE
       pktcounter++; /* increment packet counter */
       #endif
-      lock_stats();
+      #ifdef ADAPTIVE_TIMEOUT
+      timing_learn(&timing[npkt],pkt->length);
+      #endif
+      #ifdef SKIP_REPEATS
+      if(repeat == -1) { /* no checksum pass, or it was before a resync */
+        repeat = ( memcmp(pkt->data,pkt->prev,pkt->length) == 0 );
+      }
+      #else
+      repeat = 0;
+      #endif
+      stats_write_begin(aldl);
+      aldl->stats->packetaccepted++;
+      if(repeat == 1) aldl->stats->packetrepeat++;
+      sched_fetched(&sched[npkt],&aldl->stats->sched[npkt],
+                    (double)get_elapsed_us(acqstart) / 1000);
       aldl->stats->failcounter = 0; /* reset failcounter */
-      unlock_stats();
+      aldl->stats->timing[npkt] = timing[npkt]; /* publish timing model */
+      #ifdef STATS_HISTOGRAMS
+      aldl_hist_add(&aldl->stats->replylatency,get_elapsed_us(requeststamp));
+      aldl_hist_add(&aldl->stats->retries,retries);
+      retries = 0;
+      bytecounter += pkt->length;
+      #endif
+      stats_write_end(aldl);
+      /* in incremental mode, publish this packet's data right away,
+         otherwise hold it for the record at the end of the round */
+      if(aldl->incremental == 0) {
+        aldl_packet_received(aldl,npkt,repeat);
+      } else {
+        process_packet(aldl,npkt,repeat);
+        #ifdef STATS_HISTOGRAMS
+        stats_write_begin(aldl);
+        aldl_hist_add(&aldl->stats->recordinterval,
+                      get_elapsed_us(recordstamp));
+        stats_write_end(aldl);
+        recordstamp = get_time();
+        #endif
+      }
     }
 
     /* check if lagtime exceeded, and set lag state. */
@@ -242,15 +389,23 @@ void *aldl_acq(void *aldl_in) {
 
     /* all packets should be complete here */
 
-    /* process the packet */
-    process_data(aldl);
+    /* process the packet, unless that was done as each one arrived */
+    if(aldl->incremental == 0) {
+      process_data(aldl);
+      #ifdef STATS_HISTOGRAMS
+      stats_write_begin(aldl);
+      aldl_hist_add(&aldl->stats->recordinterval,get_elapsed_us(recordstamp));
+      stats_write_end(aldl);
+      recordstamp = get_time();
+      #endif
+    }
 
     noquerypkt:
 
     /* set readiness bit */
     if(aldl->ready == 0) {
       if(buffered >= aldl->bufstart) {
-        aldl->ready = 1;
+        set_ready(aldl,1);
       } else {
         buffered++;
       }
@@ -259,3 +414,157 @@ void *aldl_acq(void *aldl_in) {
   return NULL;
 }
 
+int acq_command(aldl_conf_t *aldl, int retries) {
+  aldl_comq_t auxcommand; /* aux command being sent */
+  byte auxreply[ALDL_CMDMAX]; /* and what came back */
+  int auxreplylen;
+  if(aldl_get_command(&auxcommand) == 0) return 0;
+  aldl_complete_command(aldl,&auxcommand,ALDL_CMD_SENT,NULL,0);
+  auxreplylen = aldl_send_command(auxcommand.command,auxcommand.length,
+                                  auxreply,ALDL_CMDMAX,auxcommand.delay,
+                                  retries);
+  if(auxreplylen < 0) {
+    stats_write_begin(aldl);
+    aldl->stats->auxcommandfail++;
+    stats_write_end(aldl);
+    aldl_complete_command(aldl,&auxcommand,ALDL_CMD_FAILED,NULL,0);
+  } else {
+    aldl_complete_command(aldl,&auxcommand,ALDL_CMD_DONE,
+                          auxreply,auxreplylen);
+  }
+  return 1;
+}
+
+int sched_select(aldl_commdef_t *comm, sched_state_t *sched, int *order,
+                 double now, double *wait) {
+  int n_due = 0;
+  int npkt, x;
+  double deadline;
+  *wait = -1;
+  for(npkt=0;npkt < comm->n_packets;npkt++) {
+    /* skip packet if frequency is 0 to match spec */
+    if(comm->packet[npkt].frequency == 0) continue;
+    if(sched[npkt].period > 0) {
+      /* timed packet, due once its deadline has passed */
+      if(sched[npkt].deadline > now) {
+        if(*wait < 0 || sched[npkt].deadline - now < *wait) {
+          *wait = sched[npkt].deadline - now;
+        }
+        continue;
+      }
+      deadline = sched[npkt].deadline;
+    } else {
+      /* frequency packet, due every n rounds, and its deadline is now */
+      if(sched[npkt].freq_counter < comm->packet[npkt].frequency) {
+        /* frequency requirement not met */
+        sched[npkt].freq_counter++;
+        *wait = 0;
+        continue;
+      }
+      sched[npkt].freq_counter = 1; /* reached frequency, reset to 1 */
+      deadline = now;
+    }
+    /* insertion sort by deadline, stable so ties keep config order */
+    for(x=n_due;x > 0;x--) {
+      if(sched[order[x - 1]].period > 0 &&
+         sched[order[x - 1]].deadline <= deadline) break;
+      if(sched[order[x - 1]].period == 0 && now <= deadline) break;
+      order[x] = order[x - 1];
+    }
+    order[x] = npkt;
+    n_due++;
+  }
+  return n_due;
+}
+
+void sched_fetched(sched_state_t *s, aldl_sched_t *st, double now) {
+  float interval, ref, dev;
+  if(s->period > 0) {
+    /* how late this fetch was, then advance the deadline a whole period so
+       the average rate holds.  if we've fallen more than a period behind,
+       start over from now rather than bursting to catch up. */
+    if(s->fetched == 1) {
+      st->lateness += SCHED_ALPHA * ( ( now - s->deadline ) - st->lateness );
+    }
+    s->deadline += s->period;
+    if(s->deadline < now) s->deadline = now + s->period;
+  }
+  if(s->fetched == 1) {
+    interval = (float)get_elapsed_us(s->lastfetch) / 1000;
+    if(st->interval == 0) st->interval = interval;
+    st->interval += SCHED_ALPHA * ( interval - st->interval );
+    st->rate = 1000 / st->interval;
+    ref = s->period > 0 ? s->period : st->interval;
+    dev = interval - ref;
+    st->jitter += SCHED_ALPHA * ( ( dev < 0 ? -dev : dev ) - st->jitter );
+  }
+  s->lastfetch = get_time();
+  s->fetched = 1;
+  st->fetches++;
+}
+
+#ifdef ADAPTIVE_TIMEOUT
+void timing_learn(aldl_timing_t *t, int length) {
+  float dev;
+  int x;
+  unsigned int cumulative = 0;
+
+  if(t->last_lag < 0) return; /* nothing measured */
+
+  /* moving averages, the first sample seeds them */
+  if(t->samples == 0) {
+    t->lag = t->last_lag;
+    t->bytetime = t->last_bytetime > 0 ? t->last_bytetime : 0;
+  }
+  dev = t->last_lag - t->lag;
+  t->lag += ADAPTIVE_ALPHA * dev;
+  t->lagdev += ADAPTIVE_ALPHA * ( ( dev < 0 ? -dev : dev ) - t->lagdev );
+  if(t->last_bytetime >= 0) {
+    dev = t->last_bytetime - t->bytetime;
+    t->bytetime += ADAPTIVE_ALPHA * dev;
+    t->bytedev += ADAPTIVE_ALPHA * ( ( dev < 0 ? -dev : dev ) - t->bytedev );
+  }
+  t->samples++;
+
+  /* lag histogram, decays by halving so it follows the ecm */
+  x = (int)t->last_lag;
+  if(x > ALDL_LAGHIST - 1) x = ALDL_LAGHIST - 1;
+  t->laghist[x]++;
+  t->laghist_total++;
+  if(t->laghist_total >= ADAPTIVE_HISTDECAY) {
+    t->laghist_total = 0;
+    for(x=0;x<ALDL_LAGHIST;x++) {
+      t->laghist[x] /= 2;
+      t->laghist_total += t->laghist[x];
+    }
+  }
+
+  /* 99th percentile is the upper edge of the bucket it falls in */
+  for(x=0;x<ALDL_LAGHIST;x++) {
+    cumulative += t->laghist[x];
+    if(cumulative * 100 >= t->laghist_total * 99) break;
+  }
+  t->lag_p99 = x + 1;
+
+  if(t->samples < ADAPTIVE_WARMUP) return; /* don't trust it yet */
+
+  /* first byte deadline covers the worse of the percentile or the average
+     plus a few deviations.  zero or anything past worst case is clamped by
+     aldl_get_packet. */
+  float firstbyte = t->lag + ( 4 * t->lagdev );
+  if(firstbyte < t->lag_p99) firstbyte = t->lag_p99;
+  t->firstbyte_timeout = ( firstbyte * ADAPTIVE_MARGIN ) + ADAPTIVE_SLACK;
+  t->reply_timeout = ( ( t->bytetime + ( 4 * t->bytedev ) ) * ( length - 1 ) *
+                     ADAPTIVE_MARGIN ) + ADAPTIVE_SLACK;
+}
+
+void timing_backoff(aldl_timing_t *t, int length) {
+  /* double both deadlines, up to the worst case.  a long outage times out
+     over and over, so they're capped here and not only where they're used */
+  int worst = aldl_timeout(length);
+  t->firstbyte_timeout = t->firstbyte_timeout > worst / 2 ?
+                         worst : t->firstbyte_timeout * 2;
+  t->reply_timeout = t->reply_timeout > worst / 2 ?
+                     worst : t->reply_timeout * 2;
+}
+#endif
@@ -13,8 +13,24 @@
 int aldl_reconnect(); /* go into diagnostic mode, returns 1 on success */
 
 /* fills the data section of the packet def with data, or sets it to zero if
-   fail, and returns NULL */
-byte *aldl_get_packet(aldl_packetdef_t *p);
+   fail, and returns NULL.  deadlines are taken from the timing model, and
+   the measured timing of the reply is written back to it. */
+byte *aldl_get_packet(aldl_packetdef_t *p, aldl_timing_t *t);
+
+/* the worst case time in ms to receive len bytes, the most any learned
+   deadline may be */
+int aldl_timeout(int len);
+
+/* attempt to recover a packet that failed its header or checksum test by
+   scanning the received bytes for a real frame header, shifting it into
+   place, and reading the missing tail from the stream.  returns p->data if a
+   valid frame was recovered, otherwise NULL.  timeout is the deadline for
+   each tail read in ms, 0 for the default. */
+byte *aldl_resync_packet(aldl_packetdef_t *p, aldl_commdef_t *c, int timeout);
+
+/* total number of times the comm layer has woken up to read the serial port,
+   for measuring wakeups per packet.  only meaningful in the acq thread. */
+unsigned long aldl_get_wakeups();
 
 /* generate request strings, returns allocated memory (free when finished) */
 byte *generate_request(byte mode, byte message, aldl_commdef_t *comm);
@@ -25,11 +41,55 @@ byte *generate_pktcommand(aldl_packetdef_t *packet, aldl_commdef_t *comm);
 
 /* add a command to the aux command queue, which will be sent to the datastream
    in between data acq iterations.  the command is RAW and must include all
-   necessary prefixes, suffixes, and checksums. */
+   necessary prefixes, suffixes, and checksums, and may be up to ALDL_CMDMAX
+   bytes.  delay is how long in ms to wait for the ecm's reply, which is
+   validated and returned in the result, or 0 if there is no reply.  the
+   queue is preallocated and lock-free, so this never blocks or allocates.
+   if result isn't NULL, it's used to report the outcome (see
+   aldl_cmdresult_t), set its callback and arg before calling.  returns 1 if
+   queued, or 0 if that priority's queue is full, in which case the result
+   is DROPPED and its callback has already run, in this thread. */
+int aldl_queue_command(byte *command, byte length, int delay,
+                       aldl_cmdpri_t pri, aldl_cmdresult_t *result);
+
+/* queue at normal priority, without a completion handle */
 void aldl_add_command(byte *command, byte length, int delay);
 
-/* pop a command from the aux command queue.  for use by the acq thread only */
-aldl_comq_t *aldl_get_command();
+/* post a state-style command under a key (0 to AUXCOMMAND_KEYS - 1).  unlike
+   the queue, each key holds only one command: if an older one with the same
+   key hasn't been sent yet, it's replaced (and its result, if any, is marked
+   ALDL_CMD_REPLACED, with its callback run in this thread before returning),
+   so only the latest state goes out on the bus.  keyed commands are sent
+   before queued ones.  lock-free for the acq thread, posters of the same key
+   briefly spin on each other.  returns 1 if an unsent command was replaced. */
+int aldl_post_command(aldl_conf_t *aldl, int key, byte *command, byte length,
+                      int delay, aldl_cmdresult_t *result);
+
+/* get the status of a queued command */
+aldl_cmdstatus_t aldl_command_status(aldl_cmdresult_t *result);
+
+/* wait up to timeout ms (0 is forever) for a command to finish, then return
+   its status */
+aldl_cmdstatus_t aldl_command_wait(aldl_conf_t *aldl, aldl_cmdresult_t *result,
+                                   int timeout);
+
+/* pop the next keyed command, or the highest priority queued command, into c.
+   returns 1, or 0 if the queue is empty.  for use by the acq thread only */
+int aldl_get_command(aldl_comq_t *c);
+
+/* report progress of a popped command to its owner, the reply is only used
+   for a final status.  for use by the acq thread only */
+void aldl_complete_command(aldl_conf_t *aldl, aldl_comq_t *c,
+                           aldl_cmdstatus_t status, byte *reply, int replylen);
+
+/* send a raw aux command, consume its echo, and wait up to timeout ms for the
+   ecm's reply.  the reply must come from the same address, in the same mode,
+   and pass its checksum, or the command is sent again, up to retries more
+   times.  returns the length of the reply copied into reply (up to max), or
+   -1 if it failed.  if timeout is 0, no reply is expected, only the echo is
+   verified, and 0 is returned. */
+int aldl_send_command(byte *command, int len, byte *reply, int max,
+                      int timeout, int retries);
 
 /* buffer management --------------------------------------*/
 
@@ -41,34 +101,186 @@ void aldl_data_init(aldl_conf_t *aldl);
 /* allocate communications static buffer, call in main once and leave it */
 void alloc_commbuf();
 
-/* process data from all packets, create a record, and link it to the list */
+/* take the data of packet npkt, just received, into a new segment, which
+   the next record will use.  if repeat is 1, the data is known to be the
+   same as the last packet taken, and that segment is used again instead. */
+void aldl_packet_received(aldl_conf_t *aldl, int npkt, int repeat);
+
+/* create a record from the packets received since the last one, and the
+   segments of the last one for any that weren't, and link it to the list */
 aldl_record_t *process_data(aldl_conf_t *aldl);
 
+/* compile the expressions of derived channels, and number them.  called by
+   aldl_data_init, before the decode plan. */
+void aldl_expr_compile(aldl_conf_t *aldl);
+
+/* compute every derived channel of a record being created, from the values
+   already in it */
+void aldl_expr_eval(aldl_conf_t *aldl, aldl_record_t *rec);
+
+/* set up the statistics windows of definitions with STATS.  called by
+   aldl_data_init, before the record pool is allocated. */
+void aldl_window_init(aldl_conf_t *aldl);
+
+/* add a record being created to every statistics window, after its derived
+   channels */
+void aldl_window_update(aldl_conf_t *aldl, aldl_record_t *rec);
+
+/* compile the definitions into a decode plan for each packet, called by
+   aldl_data_init */
+void aldl_decode_compile(aldl_conf_t *aldl);
+
+/* decode every definition from packet npkt, using its plan.  values go into
+   out in slot order, pkt->n_defs long, and bools into bits in bit order,
+   ALDL_BITS_WORDS(pkt->n_bits) long. */
+void aldl_decode_packet(aldl_conf_t *aldl, int npkt, aldl_data_t *out,
+                        aldl_bits_t *bits);
+
+/* same, but from a copy of the packet's bytes */
+void aldl_decode_raw(aldl_conf_t *aldl, int npkt, byte *data,
+                     aldl_data_t *out, aldl_bits_t *bits);
+
+/* decode only the bools, from a copy of the packet's bytes */
+void aldl_decode_bits(aldl_conf_t *aldl, int npkt, byte *data,
+                      aldl_bits_t *bits);
+
+/* a hash of everything in the definitions that affects decoding, so a
+   generated decoder can be matched to the definition file it was made from */
+unsigned long long aldl_decode_signature(aldl_conf_t *aldl);
+
+/* the decoder generated by gendecode into decode-gen.c, which is only linked
+   in when building with make GENDEF=<definition file>.  weak, so these are
+   NULL otherwise.  it's used in place of the plan if the signature matches
+   the loaded definitions. */
+unsigned long long aldl_gen_signature() __attribute__((weak));
+void aldl_gen_decode(int npkt, byte *data, aldl_data_t *out,
+                     aldl_bits_t *bits) __attribute__((weak));
+
+/* decode only definition n, from a copy of the bytes of its packet */
+aldl_data_t aldl_decode_def(aldl_conf_t *aldl, int n, byte *data);
+
+/* update values[n] from definition n, values is n_defs long.  this is the
+   slow reference decoder the plan must match bit for bit. */
+aldl_data_t *aldl_parse_def(aldl_conf_t *aldl, aldl_data_t *values, int n);
+
+/* check the plan against aldl_parse_def on random data, then time both and
+   print the results */
+void aldl_decode_bench(aldl_conf_t *aldl);
+
+/* create a record from the previous one, decoding only the definitions that
+   come from packet npkt, and link it to the list.  same as
+   aldl_packet_received then process_data. */
+aldl_record_t *process_packet(aldl_conf_t *aldl, int npkt, int repeat);
+
 /* set up lock structures */
 void init_locks();
 
 /* record selection ---------------------------------------*/
 
-/* return the newest or next record in the linked list.  if there is no such
-   record, return NULL. */
+/* none of these take locks.  records live in a ring buffer and are reused, so
+   a record held for too long may be overwritten; see record_valid. */
+
+/* return the newest or next record in the ring.  if there is no such
+   record, return NULL.  if rec was overwritten (an underrun), next_record
+   returns the oldest record still in the ring. */
 aldl_record_t *newest_record(aldl_conf_t *aldl);
 aldl_record_t *next_record(aldl_record_t *rec);
 
-/* return the newest or next record in the linked list.  if there is no such
+/* return the previous record in the ring, or NULL if it has been overwritten
+   or never existed */
+aldl_record_t *prev_record(aldl_record_t *rec);
+
+/* get the sequence number of a record, then after reading data from it, check
+   that it's still valid (not overwritten), seqlock style.  valid is 1 if the
+   record still holds seq. */
+aldl_seq_t record_seq(aldl_record_t *rec);
+int record_valid(aldl_record_t *rec, aldl_seq_t seq);
+
+/* return the newest or next record in the ring.  if there is no such
    record, wait forever until one is available, unless the connection to the
-   ECM is lost, in which case return NULL. */
+   ECM is lost, in which case return NULL.  waiting threads sleep until a new
+   record or state change wakes them, they don't poll. */
 aldl_record_t *newest_record_wait(aldl_conf_t *aldl, aldl_record_t *rec);
 aldl_record_t *next_record_wait(aldl_conf_t *aldl, aldl_record_t *rec);
 
-/* return the newest or next record in the linked list.  if there is no such
+/* return the newest or next record in the ring.  if there is no such
    record, wait forever until one is available.  never return anything but a
    valid record. */
 aldl_record_t *next_record_waitf(aldl_conf_t *aldl, aldl_record_t *rec);
 aldl_record_t *newest_record_waitf(aldl_conf_t *aldl, aldl_record_t *rec);
 
+/* get the value of definition n from a record.  if records are stored raw,
+   the value is decoded from the packet bytes the first time, and kept in a
+   small cache in the record for other readers.  use these instead of reading
+   the record's segments directly. */
+aldl_data_t record_get(aldl_conf_t *aldl, aldl_record_t *rec, int n);
+float record_float(aldl_conf_t *aldl, aldl_record_t *rec, int n);
+int record_int(aldl_conf_t *aldl, aldl_record_t *rec, int n);
+
+/* decode every definition of a record into out, which holds n_defs values.
+   cheaper than record_get for a consumer that wants most of them. */
+void record_decode(aldl_conf_t *aldl, aldl_record_t *rec, aldl_data_t *out);
+
+/* queries on the bool definitions of a record, which are stored packed, so
+   these take a few word operations rather than a scan of every definition.
+   which selects every bool or only the error flags.  flags are visited in
+   packet order, then definition order. */
+
+/* the number of flags that are set, and whether any are */
+int record_flag_count(aldl_conf_t *aldl, aldl_record_t *rec,
+                      aldl_flags_t which);
+int record_flag_any(aldl_conf_t *aldl, aldl_record_t *rec,
+                    aldl_flags_t which);
+
+/* the definition index of the next set flag after definition n, or the first
+   if n is -1.  returns -1 when there are no more. */
+int record_flag_next(aldl_conf_t *aldl, aldl_record_t *rec,
+                     aldl_flags_t which, int n);
+
+/* the same two, for flags that differ between rec and an earlier record
+   prev, such as prev_record(rec) */
+int record_flag_changed(aldl_conf_t *aldl, aldl_record_t *rec,
+                        aldl_record_t *prev, aldl_flags_t which);
+int record_flag_next_change(aldl_conf_t *aldl, aldl_record_t *rec,
+                            aldl_record_t *prev, aldl_flags_t which, int n);
+
+/* the time, on the same clock as rec->t, that the packet definition n comes
+   from was received, or rec->t for a derived channel.  rec->t minus this is
+   how stale the value is, which for a packet fetched less often than others
+   may be several records. */
+unsigned long record_time(aldl_conf_t *aldl, aldl_record_t *rec, int n);
+
+/* the statistics of definition n, which must have STATS set, over the last
+   len records up to rec, where len is one of the STATS_WINDOWS.  they're
+   worked out as each record is made, so this is only a copy.  returns 0,
+   or -1 if n doesn't have STATS or there's no such window. */
+int record_window(aldl_conf_t *aldl, aldl_record_t *rec, int n, int len,
+                  aldl_aggregate_t *out);
+
 /* get definition or data array index, returns -1 if not found */
 int get_index_by_name(aldl_conf_t *aldl, char *name);
 
+/* history ------------------------------------------------*/
+
+/* definitions with HISTORY keep a column of their value for every record in
+   the ring, so a series of them can be copied out at once rather than with
+   prev_record() one record at a time.  none of these take locks.
+
+   copy the value of definition n from up to max records, starting at
+   sequence number *first and stopping at the newest, into out, and each
+   record's rec->t into t unless it's NULL.  records that were overwritten
+   are left out, and *first is set to the sequence number of out[0].  a
+   *first of 0 copies the newest max records.  returns how many were copied,
+   or -1 if n has no HISTORY. */
+int history_float(aldl_conf_t *aldl, int n, aldl_seq_t *first, int max,
+                  float *out, unsigned long *t);
+int history_int(aldl_conf_t *aldl, int n, aldl_seq_t *first, int max,
+                int *out, unsigned long *t);
+
+/* the sequence number of the oldest record in the ring with rec->t at or
+   after t, to start a copy from, or 0 if there is none yet */
+aldl_seq_t history_seq(aldl_conf_t *aldl, unsigned long t);
+
 /* connection state management ----------------------------*/
 
 /* this pauses until a 'connected' state is detected */
@@ -77,15 +289,46 @@ void pause_until_connected(aldl_conf_t *aldl);
 /* this pauses until the buffer is full */
 void pause_until_buffered(aldl_conf_t *aldl);
 
-/* get/set connection state */
+/* get/set connection state.  getting it is a lock-free atomic read.  setting
+   it to a different state records a transition event and wakes any thread in
+   a wait or pause function; setting the same state again does nothing. */
 aldl_state_t get_connstate(aldl_conf_t *aldl);
 void set_connstate(aldl_state_t s, aldl_conf_t *aldl);
 
-/* misc locking -------------------------------------------*/
+/* copy the most recent state transition into ev, and return its sequence
+   number, or 0 if there has never been one. */
+unsigned long get_state_event(aldl_conf_t *aldl, aldl_state_event_t *ev);
+
+/* wait for the transition after sequence number last (as returned by either
+   of these functions), copy it into ev, and return its sequence number.
+   transitions are returned in order, unless more than ALDL_STATEHIST
+   happened since last, in which case the oldest one kept is returned.  gives
+   up after timeout ms and returns 0, or waits forever if timeout is 0. */
+unsigned long wait_state_event(aldl_conf_t *aldl, unsigned long last,
+                               aldl_state_event_t *ev, int timeout);
+
+/* set the buffer readiness flag, also wakes waiting threads */
+void set_ready(aldl_conf_t *aldl, int ready);
+
+/* statistics ---------------------------------------------*/
 
-/* lock and unlock the statistics structure */
-void lock_stats();
-void unlock_stats();
+/* copy a consistent snapshot of the statistics into out.  if timing or sched
+   point to arrays of comm->n_packets, the per packet stats are copied there
+   and out points to them, otherwise those pointers are NULL in out.  this
+   never blocks the acq thread, it just retries if it raced an update. */
+void aldl_get_stats(aldl_conf_t *aldl, aldl_stats_t *out,
+                    aldl_timing_t *timing, aldl_sched_t *sched);
+
+/* bracket updates to the statistics.  only the acq thread may do this. */
+void stats_write_begin(aldl_conf_t *aldl);
+void stats_write_end(aldl_conf_t *aldl);
+
+/* add a sample to a histogram */
+void aldl_hist_add(aldl_hist_t *h, float v);
+
+/* estimate the given percentile (0-100) of a histogram by interpolating
+   within its bin, or 0 if it's empty */
+float aldl_hist_percentile(aldl_hist_t *h, float pct);
 
 /* terminating functions -------------------------------*/
 
@@ -102,6 +345,9 @@ byte checksum_generate(byte *buf, int len);
 /* test checksum byte of buf, 1 if ok */
 int checksum_test(byte *buf, int len);
 
+/* same, and in the same pass set same to 1 if buf is identical to prev */
+int checksum_test_same(byte *buf, byte *prev, int len, int *same);
+
 /* compare a byte string n(eedle) in h(aystack), nonzero if found */
 int cmp_bytestring(byte *h, int hsize, byte *n, int nsize);
 
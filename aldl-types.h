@@ -28,19 +28,122 @@ typedef enum aldl_state {
   ALDL_PAUSE = 52
 } aldl_state_t;
 
+/* a connection state transition.  the most recent ALDL_STATEHIST of these
+   are kept, see wait_state_event in aldl-io.h */
+
+#define ALDL_STATEHIST 16
+
+typedef struct aldl_state_event {
+  unsigned long seq;   /* transition number, counts up from 1 */
+  aldl_state_t state;  /* new state */
+  aldl_state_t prev;   /* state it replaced */
+  unsigned long t;     /* timestamp, ms since startup */
+} aldl_state_event_t;
+
 /* 8-bit chunk of data */
 
 typedef unsigned char byte;
 
-/* aux command */
+/* aux commands.  a command and its reply are stored inline, up to this
+   many bytes. */
+
+#define ALDL_CMDMAX 32
+
+/* aux command priority, higher priorities are always sent first */
+typedef enum aldl_cmdpri {
+  ALDL_CMD_HIGH = 0,
+  ALDL_CMD_NORMAL = 1,
+  ALDL_CMD_LOW = 2,
+  ALDL_CMD_PRIORITIES = 3
+} aldl_cmdpri_t;
 
+/* progress of an aux command, see aldl_cmdresult_t */
+typedef enum aldl_cmdstatus {
+  ALDL_CMD_QUEUED = 0,  /* waiting to be sent */
+  ALDL_CMD_SENT = 1,    /* being written to the bus, or waiting for a reply */
+  ALDL_CMD_DONE = 2,    /* finished, the reply is filled in */
+  ALDL_CMD_FAILED = 3,  /* couldn't be delivered */
+  ALDL_CMD_DROPPED = 4, /* never queued, the queue was full */
+  ALDL_CMD_REPLACED = 5 /* superseded by a newer command with the same key
+                           before it was sent */
+} aldl_cmdstatus_t;
+
+/* completion handle for an aux command, owned by the caller and filled in by
+   the acq thread.  it must stay valid until the status is final (DONE or
+   later).  the callback, if any, runs once the status is final.  for DONE
+   and FAILED that's in the acq thread, so it must be quick.  DROPPED and
+   REPLACED are decided by whoever queues or posts, and the callback runs
+   right there, inside aldl_queue_command or aldl_post_command, so it must
+   not take anything that caller may be holding. */
+typedef struct aldl_cmdresult {
+  aldl_cmdstatus_t status; /* read with aldl_command_status */
+  byte reply[ALDL_CMDMAX]; /* what came back from the ecm */
+  int replylen;            /* number of bytes in reply */
+  void (*callback)(struct aldl_cmdresult *r, void *arg);
+  void *arg;               /* passed to callback */
+} aldl_cmdresult_t;
+
+/* a slot in the aux command queue */
 typedef struct aldl_comq {
-  byte *command; /* the actual command to send */
+  byte command[ALDL_CMDMAX]; /* the actual command to send */
   byte length; /* length of the command */
-  int delay; /* delay in ms to wait after sending */
-  struct aldl_comq *next; /* next item in linked list */
+  int delay; /* time in ms to wait for a reply after sending */
+  aldl_cmdresult_t *result; /* completion handle, or NULL */
+  unsigned long seq; /* queue sequence, internal */
 } aldl_comq_t;
 
+/* derived channels, see aldlexpr.c.  each expression is compiled into postfix
+   code for a small float stack machine. */
+
+typedef enum aldl_exprop {
+  ALDL_EXPR_CONST = 0, /* push k */
+  ALDL_EXPR_FLOAT = 1, /* push the value of float definition n */
+  ALDL_EXPR_INT = 2,   /* push the value of int or bool definition n */
+  ALDL_EXPR_ADD = 3,   /* pop two, push the result */
+  ALDL_EXPR_SUB = 4,
+  ALDL_EXPR_MUL = 5,
+  ALDL_EXPR_DIV = 6,   /* dividing by zero gives zero */
+  ALDL_EXPR_NEG = 7    /* pop one, push it negated */
+} aldl_exprop_t;
+
+typedef struct aldl_exprcode {
+  aldl_exprop_t op;
+  float k;
+  int n;
+} aldl_exprcode_t;
+
+typedef struct aldl_expr {
+  char *src;             /* the expression as written */
+  int n_code;            /* length of the code */
+  aldl_exprcode_t *code;
+} aldl_expr_t;
+
+/* a filter run over a derived channel's value as each new sample of its
+   inputs arrives, see aldlexpr.c.  its state is only touched by the
+   acquisition thread, readers only see the output in each record. */
+
+typedef enum aldl_filtertype {
+  ALDL_FILTER_EMA = 0,    /* exponential moving average */
+  ALDL_FILTER_MEDIAN = 1, /* median of the last WINDOW samples */
+  ALDL_FILTER_SLEW = 2,   /* follows the input at SLEW units per second or
+                             less */
+  ALDL_FILTER_RATE = 3    /* rate of change, in units per second */
+} aldl_filtertype_t;
+
+typedef struct aldl_filter {
+  aldl_filtertype_t type;
+  int window;     /* samples, for EMA and MEDIAN */
+  float alpha;    /* EMA weight of a new sample, 2 / ( WINDOW + 1 ) */
+  float slew;     /* SLEW limit, units per second */
+  /* ----- state ----- */
+  unsigned long t; /* when the last sample was taken, 0 before the first */
+  int n;          /* samples taken, up to window */
+  float in, out;  /* the last sample, and the output */
+  float *hist;    /* MEDIAN only: the last window samples, oldest at pos */
+  float *sorted;  /* and the same, in order */
+  int pos;
+} aldl_filter_t;
+
 /* definition of a single multi-type data array member. */
 
 typedef union aldl_data {
@@ -58,6 +161,8 @@ typedef struct aldl_define {
   /* ----- stuff for modules ----------------------------*/
   int log;            /* log data from this definition */
   int display;        /* display data from this definition */
+  int stats;          /* keep windowed statistics, see record_window */
+  int history;        /* keep a column of values, see history_float */
   int alarm_low_enable, alarm_high_enable;  /* enable high/low alarms */
   aldl_data_t alarm_low, alarm_high; /* value for alarms */
   /* ----- output definition -------------------------- */
@@ -69,6 +174,13 @@ typedef struct aldl_define {
   /* ----- conversion ----------------------------------*/
   aldl_data_t adder;         /* forms a linear equation, such as */ 
   aldl_data_t multiplier;    /* MULTIPLIER(n)+ADDER */ 
+  aldl_data_t *table;        /* or the output for each of the 256 inputs of
+                                an 8 bit field, from TABLE breakpoints.
+                                NULL if linear. */
+  aldl_expr_t *expr;         /* or an expression over other definitions, for
+                                a derived channel that doesn't come from a
+                                packet at all.  NULL if it does. */
+  aldl_filter_t *filter;     /* filters the value of expr, or NULL */
   /* ----- input definition --------------------------- */
   byte packet; /* selects which packet unique id the data comes from */
   byte offset; /* offset within packet in bytes */
@@ -77,18 +189,105 @@ typedef struct aldl_define {
   byte binary; /* offset in bits.  only works for 1 bit fields */
   byte invert; /* invert (0 means no) */
   byte err;    /* is an error code */
+  /* ----- storage ------------------------------------ */
+  int slot;    /* index of the value within its packet's segments, or of
+                  the bit, for a bool, or in the record's derived values */
 } aldl_define_t;
 
-/* definition of a record, which is a sequential linked-list type structure,
-   used as a container for a snapshot of data. */
+/* record sequence number, counts up from 1 forever.  0 is never a valid
+   record. */
+
+typedef unsigned long long aldl_seq_t;
+
+/* statistics of one channel over a window of the last few records */
+
+typedef struct aldl_aggregate {
+  int n;              /* records in the window so far, 0 if none yet */
+  float min, max;
+  float mean, var;    /* var is the population variance */
+} aldl_aggregate_t;
+
+/* kinds of definition, grouped together in a decode plan */
+
+typedef enum aldl_decodekind {
+  ALDL_DECODE_INT8 = 0,
+  ALDL_DECODE_INT16 = 1,
+  ALDL_DECODE_FLOAT8 = 2,
+  ALDL_DECODE_FLOAT16 = 3,
+  ALDL_DECODE_BOOL8 = 4,
+  ALDL_DECODE_BOOL16 = 5,
+  ALDL_DECODE_TABLE8 = 6, /* any 8 bit value, by lookup */
+  ALDL_DECODE_KINDS = 7
+} aldl_decodekind_t;
+
+/* entries in a lookup table, one for each value of an 8 bit field */
+#define ALDL_TABLE_SIZE 256
+
+/* raw packet buffers are allocated this many bytes long so a decoder may
+   read a whole word at the last field. */
+#define ALDL_DECODE_PAD 4
+
+/* one group of a packet's decode plan.  a structure of arrays holding only
+   what decoding needs, element n of each array is one definition.  display
+   and alarm metadata stays in aldl_define_t. */
+
+typedef struct aldl_decodegroup {
+  int count;           /* number of definitions in the group */
+  int *offset;         /* byte offset of the field in the packet data */
+  int *out;            /* slot of the definition, see aldl_define_t */
+  aldl_data_t *mul;    /* MULTIPLIER */
+  aldl_data_t *add;    /* ADDER */
+  aldl_data_t *min;    /* clamp range, or the whole type range if MINMAX */
+  aldl_data_t *max;    /* is off */
+  int *shift;          /* bit position, after byte order, for bools */
+  int *invert;         /* flip the bit, for bools */
+  aldl_data_t *table;  /* ALDL_TABLE_SIZE clamped outputs per definition,
+                          for the lookup group only */
+} aldl_decodegroup_t;
+
+/* bools are stored packed, in words of this type */
+
+typedef unsigned long aldl_bits_t;
+#define ALDL_BITS_WORD ( 8 * sizeof(aldl_bits_t) )
+#define ALDL_BITS_WORDS(N) ( ( (N) + ALDL_BITS_WORD - 1 ) / ALDL_BITS_WORD )
+
+/* sets of bool definitions for the record_flag queries */
+
+typedef enum aldl_flags {
+  ALDL_FLAGS_ALL = 0, /* every bool */
+  ALDL_FLAGS_ERR = 1  /* only error flags */
+} aldl_flags_t;
+
+/* the data from one reception of one packet.  a segment never changes once
+   a record uses it, so a packet that hasn't been fetched again, or came back
+   exactly the same, is shared by every record since instead of being copied
+   into each. */
+
+typedef struct aldl_segment {
+  aldl_seq_t seq;           /* version, unique among all segments */
+  unsigned long t;          /* when this data was first received, on the
+                               same clock as record t */
+  aldl_data_t *data;        /* values in slot order, unless stored raw */
+  aldl_bits_t *bits;        /* bools in bit order, unless stored raw */
+  byte *raw;                /* the packet bytes, if stored raw */
+  unsigned long long *memo; /* decoded values cache, if stored raw */
+  int refs;                 /* records using it, for the acq thread only */
+  struct aldl_segment *next; /* free list, for the acq thread only */
+} aldl_segment_t;
+
+/* definition of a record, which is a snapshot of data stored in a ring buffer
+   and identified by its sequence number. */
 
 typedef struct aldl_record {
-  /* WARNING! never traverse the linked list manually, as that would not
-     necessarily be thread-safe ... there are functions for that. */
-  struct aldl_record *next; /* linked list traversal, newer record or NULL */
-  struct aldl_record *prev; /* linked list traversal, older record or NULL */
+  /* WARNING! never access the sequence number directly, as that would not be
+     thread-safe ... there are functions for that. */
+  aldl_seq_t seq;           /* sequence number, or 0 while being written */
   unsigned long t;          /* timestamp of the record */
-  aldl_data_t *data;        /* pointer to the first data record. */
+  /* WARNING! read values with record_get and friends, not through these */
+  aldl_segment_t **seg;     /* the current segment of each packet */
+  unsigned long *pktt;      /* when each packet was last received */
+  aldl_data_t *derived;     /* values of the derived channels */
+  aldl_aggregate_t *agg;    /* windowed statistics, see record_window */
 } aldl_record_t;
 
 /* defines each packet of data and how to retrieve it */
@@ -99,7 +298,17 @@ typedef struct aldl_packetdef {
   byte *command;  /* the command string sent to retrieve the packet */
   int offset;     /* the offset of the data in bytes, aka header size */
   int frequency;  /* retrieval frequency, or 0 to disable packet */
+  float rate;     /* target retrieval rate in hz, overrides frequency */
+  int maxage;     /* max staleness in ms, overrides rate and frequency */
   byte *data;     /* pointer to the raw data buffer */
+  byte *prev;     /* the last data accepted, to spot repeats */
+  int n_defs;     /* number of values (not bools) that come from this packet */
+  int *defs;      /* their definition indexes, in slot order */
+  int n_bits;     /* number of bools that come from this packet */
+  int *bitdefs;   /* their definition indexes, in bit order */
+  aldl_bits_t *errmask; /* which of the bits are error flags */
+  struct aldl_decodegroup *plan; /* compiled decode plan, one group for each
+                                    aldl_decodekind_t, see aldldecode.c */
 } aldl_packetdef_t;
 
 /* master definition of a communication spec for an ECM. */
@@ -124,13 +333,82 @@ typedef struct aldl_commdef {
   int byteorder;             /* 1 = LSB, for binary flags only */
 } aldl_commdef_t;
 
+/* number of 1ms buckets in a learned lag histogram, the last bucket catches
+   anything longer */
+#define ALDL_LAGHIST 64
+
+/* learned request/reply timing of a single packet.  the deadlines are used by
+   aldl_get_packet, and the last_ fields are filled in by it.  see acquire.c */
+typedef struct aldl_timing {
+  unsigned int samples;   /* number of good replies learned from */
+  float lag;              /* ewma of echo-to-first-byte time, in ms */
+  float lagdev;           /* ewma of absolute deviation of lag */
+  float bytetime;         /* ewma of byte-to-byte time, in ms */
+  float bytedev;          /* ewma of absolute deviation of bytetime */
+  int lag_p99;            /* 99th percentile of lag, in ms */
+  unsigned int laghist[ALDL_LAGHIST]; /* decaying lag histogram */
+  unsigned int laghist_total; /* sum of the above */
+  int firstbyte_timeout;  /* deadline for the first reply byte, 0=default */
+  int reply_timeout;      /* deadline for the rest of the reply, 0=default */
+  float last_lag;         /* measured lag of the last reply, or -1 */
+  float last_bytetime;    /* measured byte time of the last reply, or -1 */
+} aldl_timing_t;
+
+/* a log2 histogram.  bin 0 counts samples below 1, bin n counts samples in
+   [2^(n-1),2^n), and the last bin also takes everything larger. */
+
+#define ALDL_HISTBINS 24
+
+typedef struct aldl_hist {
+  unsigned long count;    /* number of samples */
+  double sum;             /* sum of samples, for the mean */
+  float min, max;         /* extremes */
+  unsigned long bin[ALDL_HISTBINS];
+} aldl_hist_t;
+
+/* per packet scheduling results, see acquire.c */
+typedef struct aldl_sched {
+  float period;    /* target interval between fetches in ms, or 0 if the
+                      packet is scheduled by frequency instead */
+  float interval;  /* ewma of actual interval between fetches, in ms */
+  float rate;      /* achieved fetch rate, in hz */
+  float jitter;    /* ewma of abs. difference between the actual interval
+                      and the target (or average, if no target), in ms */
+  float lateness;  /* ewma of how far past its deadline a fetch was, in ms */
+  unsigned int fetches; /* number of good fetches */
+} aldl_sched_t;
+
 typedef struct aldl_stats {
+  /* everything but the wakeup stats is written only by the acq thread, and
+     is guarded by a seqlock; read it with aldl_get_stats, never directly. */
+  unsigned long seq;        /* seqlock sequence, odd while being written */
   unsigned int packetchecksumfail;  /* packets that failed checksum */
   unsigned int packetheaderfail;    /* packets that had a bunk header */
   unsigned int packetrecvtimeout;   /* packet too slow, had to retry */
+  unsigned int packetresync;  /* bad packets recovered by realigning the
+                                 stream, without a retry */
+  unsigned int auxcommandfail; /* aux commands with no valid reply */
+  unsigned int packetaccepted; /* good packets */
+  unsigned int packetrepeat; /* good packets identical to the one before,
+                                which weren't decoded again */
   unsigned int failcounter; /* this counts number of failed pkts in a row,
                                not the total amount of failures! */
   float packetspersecond;   /* this must be enabled with TRACK_PKTRATE */
+  float wakeupsperpacket;   /* serial read wakeups per good packet, also
+                               requires TRACK_PKTRATE */
+  aldl_timing_t *timing;    /* learned timing model per packet, array index
+                               matches comm->packet */
+  aldl_sched_t *sched;      /* scheduling results per packet, same index */
+  /* histograms, these must be enabled with STATS_HISTOGRAMS */
+  aldl_hist_t replylatency; /* request sent to reply complete, in us */
+  aldl_hist_t retries;      /* retries needed per good packet */
+  aldl_hist_t byterate;     /* good reply bytes per second, each second */
+  aldl_hist_t recordinterval; /* time between published records, in us */
+  /* wakeup stats, maintained by the notifier itself */
+  unsigned long notifies;   /* broadcasts sent to threads waiting on data */
+  unsigned long notifywakeups; /* times a waiting thread was woken */
+  float wakelatency;        /* avg us from broadcast to waiter running */
+  unsigned long wakelatency_max; /* worst case of the above */
 } aldl_stats_t;
 
 /* an info structure defining aldl communications and data mgmt */
@@ -139,12 +417,20 @@ typedef struct aldl_conf {
   /* settings ------------ */
   char *serialstr; /* string to init serial port */
   int n_defs;   /* number of definitions */
+  int n_derived; /* how many of them are derived, not from a packet */
+  int n_stats;   /* how many of them keep windowed statistics */
+  int n_windows; /* number of statistics windows */
+  int *window;   /* the length of each, in records */
   int bufsize;  /* the minimum number of records to maintain */
   int bufstart; /* start plugins when this many records are present */
   int rate;     /* slow down data collection, in microseconds. */
   int maxfail;  /* maximum packet retrieve fails before it's assumed that the
                    connection is no longer stable */
   int minmax;   /* enforce min/max values during conversion */
+  int lookup;   /* decode linear 8 bit values by table too */
+  int incremental; /* publish a record after every packet, rather than after
+                      every round of packets */
+  int rawrecords; /* store raw packet bytes in records, decode on access */
   /* plugin enables -------*/
   int mode4_enable; /* a special mode ... */
   int consoleif_enable;
@@ -156,7 +442,7 @@ typedef struct aldl_conf {
   char *consoleif_config;    /* path to consoleif config file */
   char *dataserver_config;   /* path to dataserver conf file */
   /* structures -----------*/
-  aldl_state_t state;   /* connection state, do not touch */
+  aldl_state_t state;   /* connection state, atomic, do not touch */
   aldl_define_t *def;   /* link to the definition set */
   aldl_record_t *r;     /* link to the latest record */
   aldl_commdef_t *comm; /* link back to the communication spec */
@@ -24,13 +24,18 @@
 
 byte *commbuf;
 
+unsigned long wakeups; /* times the comm layer woke up to read the port */
+
 /* local functions -----*/
 
 int aldl_shutup(); /* repeatedly attempt to make the ecm shut up */
 
 int aldl_waitforchatter(); /* waits forever for a byte, then bails */
 
-int aldl_timeout(int len); /* figure out a timeout period */
+/* send a request and consume its echo, copying any reply bytes that arrive
+   behind it into reply.  returns the number of reply bytes, or -1 if no echo
+   was seen. */
+int aldl_request_reply(byte *pkt, int len, byte *reply, int replylen);
 
 /************ FUNCTIONS **********************/
 
@@ -91,13 +96,88 @@ int aldl_waitforchatter(aldl_commdef_t *c) {
 int aldl_request(byte *pkt, int len) {
   serial_purge();
   serial_write(pkt,len);
-  #ifndef AGGRESSIVE
-  msleep(aldl_timeout(len));
-  #endif
+  /* no blind delay, listen_bytes returns the moment the echo lands */
   int result = listen_bytes(pkt,len,len,aldl_timeout(len));
   return result;
 }
 
+int aldl_request_reply(byte *pkt, int len, byte *reply, int replylen) {
+  int max = len + replylen; /* never read past the end of the reply */
+  if(max > ALDL_COMMBUFFER) {
+    /* realloc just to save ourselves */
+    commbuf = realloc(commbuf,sizeof(byte) * max);
+    if(commbuf == NULL) error(1,ERROR_MEMORY,"Out of memory @ realloc");
+    #ifdef DEBUGMEM
+    error(0,ERROR_MEMORY,"request %i required emergency realloc\n",max);
+    #endif
+  }
+  serial_purge();
+  serial_write(pkt,len);
+  int chars_read = 0; /* total chars read into buffer */
+  int echo_end = -1; /* position after the echo in commbuf */
+  int timeout = aldl_timeout(len);
+  int remaining = timeout;
+  timespec_t timestamp = get_time();
+  while(chars_read < max) {
+    chars_read += serial_read_wait(commbuf + chars_read, max - chars_read,
+                                   remaining);
+    wakeups++;
+    echo_end = find_bytestring(commbuf,chars_read,pkt,len);
+    if(echo_end >= 0) {
+      /* anything behind the echo is the start of the reply */
+      memcpy(reply,commbuf + echo_end,chars_read - echo_end);
+      return chars_read - echo_end;
+    }
+    remaining = timeout - (int)get_elapsed_ms(timestamp);
+    if(remaining <= 0) break;
+  }
+  #ifdef SERIAL_VERBOSE
+  printf("ECHO NOT FOUND, GOT: ");
+  printhexstring(commbuf,chars_read);
+  #endif
+  return -1;
+}
+
+int aldl_send_command(byte *command, int len, byte *reply, int max,
+                      int timeout, int retries) {
+  int attempt;
+  int chars_read; /* reply bytes so far */
+  int msglen; /* length of the reply from its header */
+  int remaining;
+  timespec_t timestamp;
+  for(attempt=0;attempt<=retries;attempt++) {
+    /* send it and consume the echo, keeping anything that followed */
+    chars_read = aldl_request_reply(command,len,reply,max);
+    if(chars_read < 0) continue; /* never saw our own echo, bus trouble */
+    if(timeout <= 0) return 0; /* not expecting a reply */
+    timestamp = get_time();
+
+    /* get the header, then the rest of the length it specifies */
+    if(chars_read < 2) {
+      if(read_bytes(reply + chars_read,2 - chars_read,timeout) == 0) continue;
+      chars_read = 2;
+    }
+    msglen = reply[1] - MSGLENGTH_MAGICNUMBER;
+    if(msglen < 3 || msglen > max) continue; /* nonsense length */
+    if(chars_read < msglen) {
+      remaining = timeout - (int)get_elapsed_ms(timestamp);
+      if(remaining <= 0 ||
+         read_bytes(reply + chars_read,msglen - chars_read,remaining) == 0) {
+        continue;
+      }
+    }
+
+    /* it has to come from the ecm we addressed, in the mode we asked for */
+    if(reply[0] == command[0] && reply[2] == command[2] &&
+       checksum_test(reply,msglen) == 1) return msglen;
+    #ifdef SERIAL_VERBOSE
+    printf("BAD AUX COMMAND REPLY: ");
+    printhexstring(reply,msglen);
+    #endif
+  }
+  return -1;
+}
+
 int aldl_timeout(int len) {
   int timeout = ( len * SERIAL_BYTES_PER_MS ) + ( len * ECMLAGTIME );
   /* if the timeout is too short, set it higher */
@@ -114,35 +194,97 @@ int aldl_shutup(aldl_commdef_t *c) {
   return 0;
 }
 
-byte *aldl_get_packet(aldl_packetdef_t *p) {
-  if(aldl_request(p->command, 5) == 0) return NULL;
-  /* get actual data */
-  if(read_bytes(p->data, p->length, aldl_timeout(p->length)) == 0) {
-    /* failed to get data */
-    memset(p->data,0,p->length);
-    return NULL;
+byte *aldl_get_packet(aldl_packetdef_t *p, aldl_timing_t *t) {
+  t->last_lag = -1;
+  t->last_bytetime = -1;
+  /* learned deadlines, but never longer than the theoretical worst case */
+  int worst = aldl_timeout(p->length);
+  int firstbyte_timeout = t->firstbyte_timeout;
+  int reply_timeout = t->reply_timeout;
+  if(firstbyte_timeout <= 0 || firstbyte_timeout > worst) {
+    firstbyte_timeout = worst;
+  }
+  if(reply_timeout <= 0 || reply_timeout > worst) reply_timeout = worst;
+
+  /* the echo and reply are consumed as one stream, so the reply may be
+     partially here already */
+  int got = aldl_request_reply(p->command, 5, p->data, p->length);
+  if(got < 0) return NULL;
+  timespec_t timestamp = get_time();
+
+  /* wait for the ecm to start talking.  if the reply came in with the echo,
+     its turnaround can't be seen from here, so the lag isn't measured and
+     the learned deadline isn't dragged down by it */
+  if(got == 0) {
+    if(read_bytes(p->data, 1, firstbyte_timeout) == 0) goto FAIL;
+    got = 1;
+    t->last_lag = (float)get_elapsed_us(timestamp) / 1000;
+  }
+
+  /* get the rest of the actual data */
+  timestamp = get_time();
+  if(read_bytes(p->data + got, p->length - got, reply_timeout) == 0) goto FAIL;
+  if(p->length - got > 0) {
+    t->last_bytetime = (float)get_elapsed_us(timestamp) / 1000 /
+                       ( p->length - got );
   }
   return p->data;
+
+  FAIL: /* failed to get data */
+  memset(p->data,0,p->length);
+  return NULL;
+}
+
+byte *aldl_resync_packet(aldl_packetdef_t *p, aldl_commdef_t *c, int timeout) {
+  int worst = aldl_timeout(p->length);
+  if(timeout <= 0 || timeout > worst) timeout = worst;
+  byte address = c->pcm_address;
+  byte msglength = calc_msglength(p->length);
+  int discarded = 0; /* bytes thrown away while hunting */
+  int k;
+  while(discarded < p->length) {
+    /* hunt for the next header past the start of the buffer.  a match on the
+       very last byte only has the address to go on. */
+    for(k=1;k<p->length;k++) {
+      if(p->data[k] != address) continue;
+      if(k == p->length - 1 || p->data[k + 1] == msglength) break;
+    }
+    if(k == p->length) return NULL; /* all garbage, nothing to align to */
+    #ifdef SERIAL_VERBOSE
+    printf("RESYNC: header candidate at %i\n",k);
+    #endif
+    /* shift the candidate frame into place and read the rest of it */
+    memmove(p->data,p->data + k,p->length - k);
+    discarded += k;
+    if(read_bytes(p->data + p->length - k, k, timeout) == 0) return NULL;
+    if(p->data[1] != msglength) continue; /* unverified, keep hunting */
+    if(c->checksum_enable == 0 || checksum_test(p->data,p->length) == 1) {
+      return p->data;
+    }
+  }
+  return NULL;
 }
 
 inline int read_bytes(byte *str, int bytes, int timeout) {
   int bytes_read = 0;
+  int remaining = timeout; /* time left before deadline */
   timespec_t timestamp = get_time();
   #ifdef SERIAL_VERBOSE
   printf("**READ_BYTES %i bytes %i timeout : ",bytes,timeout);
   #endif
   do {
-    bytes_read += serial_read(str + bytes_read, bytes - bytes_read);
+    /* sleeps in the driver until bytes arrive, so each pass is a wakeup */
+    bytes_read += serial_read_wait(str + bytes_read, bytes - bytes_read,
+                                   remaining);
+    wakeups++;
     if(bytes_read >= bytes) {
       #ifdef SERIAL_VERBOSE
       printhexstring(str,bytes);
       #endif
       return 1;
     }
-    #ifndef AGGRESSIVE
-    usleep(SLEEPYTIME);
-    #endif
-  } while (get_elapsed_ms(timestamp) <= timeout);
+    remaining = timeout - (int)get_elapsed_ms(timestamp);
+  } while (remaining > 0);
   #ifdef SERIAL_VERBOSE
   printf("TIMEOUT TRYING TO READ %i BYTES, GOT: ",bytes);
   printhexstring(str,bytes_read);
@@ -180,25 +322,26 @@ int listen_bytes(byte *str, int len, int max, int timeout) {
   }
   int chars_read = 0; /* total chars read into buffer */
   int chars_in = 0; /* chars added to buffer */
+  int remaining = timeout; /* time left before deadline */
   timespec_t timestamp = get_time(); /* timestamp beginning of op */
   #ifdef SERIAL_VERBOSE
   printf("LISTEN: ");
   printhexstring(str,len);
   #endif
   while(chars_read < max) {
-    chars_in = serial_read(commbuf + chars_read,max - chars_read);
+    /* a timeout of zero or less waits forever, so sleep in big chunks */
+    chars_in = serial_read_wait(commbuf + chars_read,max - chars_read,
+                                timeout > 0 ? remaining : 1000);
+    wakeups++;
     if(chars_in > 0) {
       chars_read += chars_in; /* mv cursor */
       if(cmp_bytestring(commbuf,chars_read,str,len) == 1) {
         return 1;
       }
     }
-    /* timeout and throttling routine */
-    #ifndef AGGRESSIVE
-    usleep(SLEEPYTIME); /* timing delay */
-    #endif
     if(timeout > 0) { /* timeout is enabled, we arent waiting forever */
-      if(get_elapsed_ms(timestamp) >= timeout) { /* timeout exceeded */
+      remaining = timeout - (int)get_elapsed_ms(timestamp);
+      if(remaining <= 0) { /* timeout exceeded */
         #ifdef SERIAL_VERBOSE
         printf("LISTEN TIMEOUT\n");
         #endif
@@ -237,6 +380,10 @@ byte *generate_mode(byte mode, aldl_commdef_t *comm) {
   return tmp;
 }
 
+unsigned long aldl_get_wakeups() {
+  return wakeups;
+}
+
 void alloc_commbuf() {
   commbuf = smalloc(sizeof(byte) * ALDL_COMMBUFFER);
 }
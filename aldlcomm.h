@@ -1,7 +1,7 @@
 #ifndef _ALDLCOMM_H
 #define _ALDLCOMM_H
 
-/* sends a request, delays for a calculated time, and waits for an echo.  if
+/* sends a request and waits for an echo, returning as soon as it arrives.  if
    the request is successful, returns 1, otherwise 0. */
 int aldl_request(byte *pkt, int len);
 
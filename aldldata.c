@@ -6,6 +6,8 @@
 #include <time.h>
 #include <pthread.h>
 #include <limits.h>
+#include <errno.h>
+#include <sched.h>
 
 #include "serio.h"
 #include "config.h"
@@ -18,7 +20,7 @@
 /************ SCOPE *********************************
   This object contains all of the functions used for
   structuring and parsing the ALDL data structures,
-  including locking and serializing of record retr.
+  including locking and sequencing of record retr.
 ****************************************************/
 
 /* -------- globalstuffs ------------------ */
@@ -26,44 +28,162 @@
 /* locking */
 typedef enum aldl_lock {
   LOCK_CONNSTATE = 0,
-  LOCK_RECORDPTR = 1,
-  LOCK_STATS = 2,
-  LOCK_COMQ = 3,
-  N_LOCKS = 4
+  N_LOCKS = 1
 } aldl_lock_t;
 pthread_mutex_t *aldllock;
 
 timespec_t firstrecordtime; /* timestamp used to calc. relative time */
 
-/* primary memory pool for record storage */
+/* primary memory pool for record storage.  a record with sequence number
+   seq always lives in slot seq % ringsize.  only the acq thread writes. */
 aldl_record_t *recordbuffer; /* circular pool for records */
-aldl_data_t *databuffer; /* circular pool for data */
-unsigned int indexbuffer; /* index for both of above */
+unsigned int ringsize; /* number of slots in it */
+aldl_seq_t headseq; /* newest published sequence number */
 
-/* linked list forming a FIFO queue of commands */
-aldl_comq_t *comq;
+/* segments hold the data, records point at one per packet.  each packet
+   has a free list that grows by SEGMENT_CHUNK when it runs dry.  segment
+   memory is never returned to the system, so a reader holding a record that
+   was overwritten reads stale data rather than freed memory, and finds out
+   from record_valid.  all of this belongs to the acq thread.
 
-/* --------- local function decl. ---------------- */
+   if RAW_RECORDS is set, a segment holds packet bytes and RECORD_MEMO cached
+   values.  a cache entry is the decoded value in the low half and a tag of
+   the segment's seq and the definition in the high half, so one written for
+   a segment that has since been reused never matches.  seq is 0 while a
+   segment is being filled and is published after its data, seqlock style,
+   and a reader only writes an entry if seq didn't change while it decoded. */
+aldl_segment_t **segbuffer; /* n_packets pointers for each ring slot */
+unsigned long *pkttbuffer; /* and n_packets receive times */
+aldl_data_t *derivedbuffer; /* and n_derived derived values */
+aldl_aggregate_t *aggbuffer; /* and the statistics of each window */
+
+/* the history store, a column of ringsize values for each definition with
+   HISTORY, element x of each belonging to ring slot x.  it's written with
+   the rest of the slot, and read back by checking the slot's seq. */
+aldl_data_t *histbuffer;
+unsigned long *histtime; /* rec->t of each slot, as a column */
+int *histdefs; /* definition index of each column */
+int *histslot; /* column of each definition, or -1 */
+int n_hist; /* number of columns */
+aldl_segment_t **segfree; /* free list of each packet */
+aldl_segment_t **segnew; /* received since the last record, or NULL */
+unsigned long *segnewt; /* and when */
+int *segseen; /* a packet has been taken since the first record */
+aldl_seq_t segseq; /* last segment version handed out */
+
+/* wakeups for threads blocked waiting on a record, a state change or a
+   command.  each kind of wait sleeps on its own condition, so a new record
+   doesn't wake a thread waiting for something else.  notifiers skip the
+   broadcast entirely if nobody is waiting. */
+typedef enum aldl_waitfor {
+  WAIT_RECORD = 0,
+  WAIT_STATE = 1,
+  WAIT_COMMAND = 2,
+  N_WAITFOR = 3
+} aldl_waitfor_t;
+#define NOTIFY_RECORD ( 1 << WAIT_RECORD )
+#define NOTIFY_STATE ( 1 << WAIT_STATE )
+#define NOTIFY_COMMAND ( 1 << WAIT_COMMAND )
+pthread_mutex_t notifylock;
+pthread_cond_t notifycond[N_WAITFOR];
+int notifywaiters[N_WAITFOR]; /* number of threads in each wait, atomic */
+timespec_t notifytime; /* time of the last broadcast, for wake latency */
+
+/* connection state transition history, written under LOCK_CONNSTATE.  the
+   transition numbered n is in statehist[n % ALDL_STATEHIST]. */
+aldl_state_event_t statehist[ALDL_STATEHIST];
+unsigned long statecount; /* number of transitions, atomic */
+timespec_t statebase; /* time base for transition timestamps */
+unsigned long long wakelatency_total; /* sum of wake latencies in us */
 
-/* update the value in the record from definition n */
-aldl_data_t *aldl_parse_def(aldl_conf_t *aldl, aldl_record_t *r, int n);
+/* bounded lock-free FIFO queues of commands, one per priority.  each slot's
+   seq says whose turn it is: a producer may fill slot pos when seq == pos,
+   and the consumer may take it when seq == pos + 1. */
+typedef struct _cmdqueue {
+  aldl_comq_t slot[AUXCOMMAND_QUEUESIZE];
+  unsigned long head; /* next position to pop */
+  unsigned long tail; /* next position to push */
+} cmdqueue_t;
+cmdqueue_t *comq;
+
+/* keyed last-writer-wins command slots.  seq is a seqlock, odd while a poster
+   is writing.  pending holds the seq of an unsent command, and the acq thread
+   takes it by swapping that exact value for 0, so a newer post always wins. */
+typedef struct _cmdslot {
+  aldl_comq_t c;
+  unsigned long seq;
+  unsigned long pending; /* seq of the command waiting to be sent, or 0 */
+  int busy; /* serializes posters */
+} cmdslot_t;
+cmdslot_t *comslot;
+
+/* --------- local function decl. ---------------- */
 
 /* allocate record and timestamp it */
 aldl_record_t *aldl_create_record(aldl_conf_t *aldl);
 
-/* link a prepared record to the linked list */
+/* publish a prepared record as the newest in the ring */
 void link_record(aldl_record_t *rec, aldl_conf_t *aldl);
 
-/* fill a prepared record with data */
-aldl_record_t *aldl_fill_record(aldl_conf_t *aldl, aldl_record_t *rec);
+/* take a segment for packet npkt off its free list, growing it if empty.
+   its seq is 0 until segment_publish, after its data is written. */
+aldl_segment_t *segment_alloc(aldl_conf_t *aldl, int npkt);
+void segment_publish(aldl_segment_t *seg);
+
+/* add SEGMENT_CHUNK segments to the free list of packet npkt */
+void segment_grow(aldl_conf_t *aldl, int npkt);
+
+/* drop a record's reference to a segment, freeing it if it was the last */
+void segment_release(aldl_segment_t *seg, int npkt);
+
+/* the bools of packet npkt in a record, decoded into buf if stored raw */
+aldl_bits_t *record_bits(aldl_conf_t *aldl, aldl_record_t *rec, int npkt,
+                         aldl_bits_t *buf);
 
 /* set and unset locks, wrapper with error checking for pthread funcs */
 inline void set_lock(aldl_lock_t lock_number);
 inline void unset_lock(aldl_lock_t lock_number);
 
+/* wake the threads blocked in the kinds of wait in what, a mask of
+   NOTIFY_ flags */
+void aldl_notify(aldl_conf_t *aldl, int what);
+
+/* a waiting thread brackets its condition checks with enter and leave, and
+   calls sleep (with notifylock held) whenever the condition isn't met.  w
+   is what it's waiting for, and must be the same for all three. */
+void aldl_wait_enter(aldl_waitfor_t w);
+void aldl_wait_sleep(aldl_conf_t *aldl, aldl_waitfor_t w);
+void aldl_wait_leave(aldl_waitfor_t w);
+
+/* same as aldl_wait_sleep but gives up at a CLOCK_MONOTONIC deadline, returns
+   1 if the deadline has passed */
+int aldl_wait_sleep_until(aldl_conf_t *aldl, aldl_waitfor_t w,
+                          struct timespec *deadline);
+
+/* copy the transition after last, or the oldest kept.  call with
+   LOCK_CONNSTATE held.  returns the seq of the copied event, or 0. */
+unsigned long copy_state_event(unsigned long last, aldl_state_event_t *ev);
+
 /* allocate memory pool */
 void aldl_alloc_pool(aldl_conf_t *aldl);
 
+/* allocate the history store, called by aldl_alloc_pool */
+void aldl_alloc_history(aldl_conf_t *aldl);
+
+/* write the history columns of a record being created */
+void history_store(aldl_conf_t *aldl, aldl_record_t *rec);
+
+/* copy definition n out of the history store, for history_float and
+   history_int.  out is an int array if isint is 1, or else a float array. */
+int history_copy(aldl_conf_t *aldl, int n, aldl_seq_t *first, int max,
+                 void *out, int isint, unsigned long *t);
+
+/* allocate and initialize the command queues */
+void aldl_alloc_comq();
+
+/* get a CLOCK_MONOTONIC deadline timeout ms from now */
+void aldl_deadline(struct timespec *deadline, int timeout);
+
 /* --------------------------------------------------------- */
 
 void init_locks() {
@@ -75,6 +195,89 @@ void init_locks() {
     if(pthreaderr != 0) error(1,ERROR_LOCK,
          "error initializing lock %i, pthread error %i",x,pthreaderr);
   }
+  /* the notifier uses the monotonic clock so timed waits survive clock
+     changes */
+  pthread_condattr_t condattr;
+  pthread_condattr_init(&condattr);
+  pthread_condattr_setclock(&condattr,CLOCK_MONOTONIC);
+  pthreaderr = pthread_mutex_init(&notifylock,NULL);
+  for(x=0;x<N_WAITFOR;x++) {
+    if(pthreaderr == 0) {
+      pthreaderr = pthread_cond_init(&notifycond[x],&condattr);
+    }
+    notifywaiters[x] = 0;
+  }
+  if(pthreaderr != 0) error(1,ERROR_LOCK,
+         "error initializing notifier, pthread error %i",pthreaderr);
+  pthread_condattr_destroy(&condattr);
+  wakelatency_total = 0;
+  statecount = 0;
+  statebase = get_time();
+}
+
+void aldl_notify(aldl_conf_t *aldl, int what) {
+  int x;
+  int waiting = 0; /* the kinds asked for that have waiters */
+  /* whatever was just published must be visible before we look for waiters,
+     pairs with the waiter incrementing notifywaiters before checking */
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  for(x=0;x<N_WAITFOR;x++) {
+    if(( what & ( 1 << x ) ) == 0) continue;
+    if(__atomic_load_n(&notifywaiters[x],__ATOMIC_SEQ_CST) == 0) continue;
+    waiting |= 1 << x;
+  }
+  if(waiting == 0) return;
+  pthread_mutex_lock(&notifylock);
+  notifytime = get_time();
+  rf_atomic_add(&aldl->stats->notifies,1);
+  for(x=0;x<N_WAITFOR;x++) {
+    if(( waiting & ( 1 << x ) ) != 0) pthread_cond_broadcast(&notifycond[x]);
+  }
+  pthread_mutex_unlock(&notifylock);
+}
+
+void aldl_wait_enter(aldl_waitfor_t w) {
+  pthread_mutex_lock(&notifylock);
+  __atomic_add_fetch(&notifywaiters[w],1,__ATOMIC_SEQ_CST);
+}
+
+void aldl_wait_sleep(aldl_conf_t *aldl, aldl_waitfor_t w) {
+  aldl_wait_sleep_until(aldl,w,NULL);
+}
+
+int aldl_wait_sleep_until(aldl_conf_t *aldl, aldl_waitfor_t w,
+                          struct timespec *deadline) {
+  if(deadline == NULL) {
+    pthread_cond_wait(&notifycond[w],&notifylock);
+  } else if(pthread_cond_timedwait(&notifycond[w],&notifylock,deadline)
+            == ETIMEDOUT) {
+    return 1;
+  }
+  /* these are only written with notifylock held, atomics are for readers */
+  aldl_stats_t *st = aldl->stats;
+  if(st->notifies == 0) return 0; /* spurious, nothing to measure from */
+  unsigned long lag = get_elapsed_us(notifytime);
+  rf_atomic_add(&wakelatency_total,lag);
+  rf_atomic_add(&st->notifywakeups,1);
+  if(lag > st->wakelatency_max) {
+    __atomic_store_n(&st->wakelatency_max,lag,__ATOMIC_RELAXED);
+  }
+  return 0;
+}
+
+void aldl_deadline(struct timespec *deadline, int timeout) {
+  clock_gettime(CLOCK_MONOTONIC,deadline);
+  deadline->tv_sec += timeout / 1000;
+  deadline->tv_nsec += (long)( timeout % 1000 ) * 1000000;
+  if(deadline->tv_nsec >= 1000000000) {
+    deadline->tv_sec++;
+    deadline->tv_nsec -= 1000000000;
+  }
+}
+
+void aldl_wait_leave(aldl_waitfor_t w) {
+  __atomic_sub_fetch(&notifywaiters[w],1,__ATOMIC_SEQ_CST);
+  pthread_mutex_unlock(&notifylock);
 }
 
 inline void set_lock(aldl_lock_t lock_number) {
@@ -91,52 +294,193 @@ inline void unset_lock(aldl_lock_t lock_number) {
           "error unsetting lock %i, pthread error code %i",lock_number,rtval);
 }
 
-void lock_stats() {
-  set_lock(LOCK_STATS);
+void stats_write_begin(aldl_conf_t *aldl) {
+  aldl_stats_t *st = aldl->stats;
+  __atomic_store_n(&st->seq,st->seq + 1,__ATOMIC_RELAXED);
+  rf_fence_write();
+}
+
+void stats_write_end(aldl_conf_t *aldl) {
+  aldl_stats_t *st = aldl->stats;
+  rf_atomic_set(&st->seq,st->seq + 1);
+}
+
+void aldl_get_stats(aldl_conf_t *aldl, aldl_stats_t *out,
+                    aldl_timing_t *timing, aldl_sched_t *sched) {
+  aldl_stats_t *st = aldl->stats;
+  size_t n = aldl->comm->n_packets;
+  unsigned long seq;
+  do {
+    seq = rf_atomic_get(&st->seq);
+    if(seq & 1) continue; /* writer is mid-update */
+    memcpy(out,st,sizeof(aldl_stats_t));
+    if(timing != NULL) memcpy(timing,st->timing,sizeof(aldl_timing_t) * n);
+    if(sched != NULL) memcpy(sched,st->sched,sizeof(aldl_sched_t) * n);
+    rf_fence_read();
+  } while((seq & 1) || __atomic_load_n(&st->seq,__ATOMIC_RELAXED) != seq);
+  out->timing = timing;
+  out->sched = sched;
+  /* the notifier keeps its own stats, outside the seqlock */
+  out->notifies = __atomic_load_n(&st->notifies,__ATOMIC_RELAXED);
+  out->notifywakeups = __atomic_load_n(&st->notifywakeups,__ATOMIC_RELAXED);
+  out->wakelatency_max = __atomic_load_n(&st->wakelatency_max,
+                                         __ATOMIC_RELAXED);
+  out->wakelatency = out->notifywakeups == 0 ? 0 :
+    __atomic_load_n(&wakelatency_total,__ATOMIC_RELAXED) / out->notifywakeups;
+}
+
+void aldl_hist_add(aldl_hist_t *h, float v) {
+  int bin = 0;
+  float edge = 1;
+  while(v >= edge && bin < ALDL_HISTBINS - 1) {
+    bin++;
+    edge *= 2;
+  }
+  h->bin[bin]++;
+  if(h->count == 0 || v < h->min) h->min = v;
+  if(h->count == 0 || v > h->max) h->max = v;
+  h->sum += v;
+  h->count++;
+}
+
+float aldl_hist_percentile(aldl_hist_t *h, float pct) {
+  int bin;
+  unsigned long cumulative = 0;
+  float target = h->count * pct / 100;
+  float lower = 0, upper = 1, est;
+  if(h->count == 0) return 0;
+  for(bin=0;bin<ALDL_HISTBINS - 1;bin++) {
+    if(cumulative + h->bin[bin] >= target) break;
+    cumulative += h->bin[bin];
+    lower = upper;
+    upper *= 2;
+  }
+  /* interpolate within the bin, then clamp to what was actually seen */
+  if(h->bin[bin] == 0) {
+    est = upper;
+  } else {
+    est = lower + ( upper - lower ) * ( target - cumulative ) / h->bin[bin];
+  }
+  if(est < h->min) est = h->min;
+  if(est > h->max) est = h->max;
+  return est;
 }
 
-void unlock_stats() {
-  unset_lock(LOCK_STATS);
+void aldl_packet_received(aldl_conf_t *aldl, int npkt, int repeat) {
+  aldl_packetdef_t *pkt = &aldl->comm->packet[npkt];
+  aldl_segment_t *seg;
+  segnewt[npkt] = get_elapsed_ms(firstrecordtime);
+
+  /* same bytes as the last one taken, which is pending or in the newest
+     record, so share that */
+  if(repeat == 1 && segseen[npkt] == 1) {
+    if(segnew[npkt] == NULL) segnew[npkt] = newest_record(aldl)->seg[npkt];
+    return;
+  }
+
+  seg = segment_alloc(aldl,npkt);
+  if(seg->raw != NULL) { /* decoded later, by whoever reads it */
+    memcpy(seg->raw,pkt->data,pkt->length);
+  } else {
+    aldl_decode_packet(aldl,npkt,seg->data,seg->bits);
+  }
+  segment_publish(seg);
+  memcpy(pkt->prev,pkt->data,pkt->length);
+  segseen[npkt] = 1;
+  /* received twice before a record, the first one was never used */
+  if(segnew[npkt] != NULL && segnew[npkt]->refs == 0) {
+    segnew[npkt]->next = segfree[npkt];
+    segfree[npkt] = segnew[npkt];
+  }
+  segnew[npkt] = seg;
 }
 
 aldl_record_t *process_data(aldl_conf_t *aldl) {
+  int npkt;
+  aldl_segment_t *seg;
+  aldl_record_t *prev = newest_record(aldl);
   aldl_record_t *rec = aldl_create_record(aldl);
-  aldl_fill_record(aldl,rec);
+  /* packets that weren't received carry over, by reference */
+  for(npkt=0;npkt<aldl->comm->n_packets;npkt++) {
+    if(segnew[npkt] != NULL) {
+      seg = segnew[npkt];
+      rec->pktt[npkt] = segnewt[npkt];
+    } else {
+      seg = prev->seg[npkt];
+      rec->pktt[npkt] = prev->pktt[npkt];
+    }
+    segnew[npkt] = NULL;
+    seg->refs++;
+    rec->seg[npkt] = seg;
+  }
+  aldl_expr_eval(aldl,rec);
+  aldl_window_update(aldl,rec);
+  history_store(aldl,rec);
   link_record(rec,aldl);
   return rec;
 }
 
+aldl_record_t *process_packet(aldl_conf_t *aldl, int npkt, int repeat) {
+  aldl_packet_received(aldl,npkt,repeat);
+  return process_data(aldl);
+}
+
 void link_record(aldl_record_t *rec, aldl_conf_t *aldl) {
-  rec->next = NULL; /* terminate linked list */
-  rec->prev = aldl->r; /* previous link */
-  set_lock(LOCK_RECORDPTR);
-  aldl->r->next = rec; /* attach to linked list */
-  aldl->r = rec; /* fix master link */
-  unset_lock(LOCK_RECORDPTR);
+  /* the slot becomes valid under its new number, then it's the newest.
+     only this thread writes headseq, but others read it, so it's stored
+     whole, and after the record so everything up to it is valid. */
+  aldl_seq_t seq = headseq + 1;
+  rf_atomic_set(&rec->seq,seq);
+  rf_atomic_set(&headseq,seq);
+  rf_atomic_set(&aldl->r,rec);
+  aldl_notify(aldl,NOTIFY_RECORD);
 }
 
 void aldl_data_init(aldl_conf_t *aldl) {
+  int npkt;
+  aldl_segment_t *seg;
+  aldl_packetdef_t *pkt;
+  aldl_expr_compile(aldl);
+  aldl_window_init(aldl);
+  aldl_decode_compile(aldl);
   aldl_alloc_pool(aldl);
-  aldl_record_t *rec = aldl_create_record(aldl);
-  set_lock(LOCK_RECORDPTR);
-  rec->next = NULL;
-  rec->prev = NULL;
-  aldl->r = rec;
-  unset_lock(LOCK_RECORDPTR);
   firstrecordtime = get_time();
-  comq = NULL; /* no records yet */
+  /* the first record is all zero */
+  aldl_record_t *rec = aldl_create_record(aldl);
+  for(npkt=0;npkt<aldl->comm->n_packets;npkt++) {
+    pkt = &aldl->comm->packet[npkt];
+    seg = segment_alloc(aldl,npkt);
+    if(seg->raw != NULL) {
+      memset(seg->raw,0,pkt->length);
+    } else {
+      memset(seg->data,0,sizeof(aldl_data_t) * pkt->n_defs);
+      memset(seg->bits,0,sizeof(aldl_bits_t) * ALDL_BITS_WORDS(pkt->n_bits));
+    }
+    segment_publish(seg);
+    seg->refs = 1;
+    rec->seg[npkt] = seg;
+    rec->pktt[npkt] = 0;
+  }
+  aldl_expr_eval(aldl,rec);
+  history_store(aldl,rec);
+  link_record(rec,aldl);
+  aldl_alloc_comq();
 }
 
 aldl_record_t *aldl_create_record(aldl_conf_t *aldl) {
-  /* get memory pool addresses */
-  aldl_record_t *rec = &recordbuffer[indexbuffer];
-  rec->data = &databuffer[indexbuffer * aldl->n_defs];
+  /* the slot after the newest, which holds the oldest record */
+  aldl_record_t *rec = &recordbuffer[( headseq + 1 ) % ringsize];
 
-  /* advance pool index (for next time around) */
-  if(indexbuffer > aldl->bufsize - 2) { /* end of buffer */
-    indexbuffer = 0; /* return to beginning */
-  } else {
-    indexbuffer++;
+  /* invalidate it before touching the data, so readers still holding the
+     old record can tell it's gone */
+  __atomic_store_n(&rec->seq,0,__ATOMIC_RELAXED);
+  rf_fence_write();
+
+  /* it no longer holds its segments.  the pointers stay, for readers that
+     haven't noticed yet, and are replaced when the record is filled. */
+  int npkt;
+  for(npkt=0;npkt<aldl->comm->n_packets;npkt++) {
+    segment_release(rec->seg[npkt],npkt);
   }
 
   /* timestamp record */
@@ -150,22 +494,236 @@ aldl_record_t *aldl_create_record(aldl_conf_t *aldl) {
   return rec;
 }
 
-aldl_record_t *aldl_fill_record(aldl_conf_t *aldl, aldl_record_t *rec) {
-  /* process packet data */
-  int def_n;
-  for(def_n=0;def_n<aldl->n_defs;def_n++) {
-    aldl_parse_def(aldl,rec,def_n);
+aldl_segment_t *segment_alloc(aldl_conf_t *aldl, int npkt) {
+  aldl_segment_t *seg;
+  if(segfree[npkt] == NULL) segment_grow(aldl,npkt);
+  seg = segfree[npkt];
+  segfree[npkt] = seg->next;
+  seg->next = NULL;
+  seg->refs = 0;
+  /* a reader of an overwritten record may still be decoding it, so mark it
+     changing before the data is touched */
+  __atomic_store_n(&seg->seq,0,__ATOMIC_RELAXED);
+  rf_fence_write();
+  seg->t = get_elapsed_ms(firstrecordtime);
+  return seg;
+}
+
+void segment_publish(aldl_segment_t *seg) {
+  segseq++;
+  rf_atomic_set(&seg->seq,segseq);
+}
+
+void segment_grow(aldl_conf_t *aldl, int npkt) {
+  aldl_packetdef_t *pkt = &aldl->comm->packet[npkt];
+  aldl_segment_t *seg = smalloc(sizeof(aldl_segment_t) * SEGMENT_CHUNK);
+  byte *raw = NULL;
+  unsigned long long *memo = NULL;
+  aldl_data_t *data = NULL;
+  aldl_bits_t *bits = NULL;
+  int words = ALDL_BITS_WORDS(pkt->n_bits) + 1;
+  size_t size;
+  int x;
+
+  if(aldl->rawrecords == 1) {
+    /* padded for the decoder, like the packet buffers */
+    size = pkt->length * SEGMENT_CHUNK + ALDL_DECODE_PAD;
+    raw = smalloc(size);
+    memset(raw,0,size);
+    size = sizeof(unsigned long long) * RECORD_MEMO * SEGMENT_CHUNK;
+    memo = smalloc(size);
+    memset(memo,0,size);
+  } else {
+    data = smalloc(sizeof(aldl_data_t) * ( pkt->n_defs + 1 ) * SEGMENT_CHUNK);
+    bits = smalloc(sizeof(aldl_bits_t) * words * SEGMENT_CHUNK);
   }
-  return rec;
+
+  for(x=0;x<SEGMENT_CHUNK;x++) {
+    seg[x].seq = 0;
+    seg[x].t = 0;
+    seg[x].refs = 0;
+    seg[x].raw = raw != NULL ? raw + pkt->length * x : NULL;
+    seg[x].memo = memo != NULL ? memo + RECORD_MEMO * x : NULL;
+    seg[x].data = data != NULL ? data + ( pkt->n_defs + 1 ) * x : NULL;
+    seg[x].bits = bits != NULL ? bits + words * x : NULL;
+    seg[x].next = segfree[npkt];
+    segfree[npkt] = &seg[x];
+  }
+
+  #ifdef DEBUGMEM
+  printf("packet %i: %i more segments\n",npkt,SEGMENT_CHUNK);
+  #endif
+}
+
+void segment_release(aldl_segment_t *seg, int npkt) {
+  if(seg == NULL) return; /* slot never used */
+  seg->refs--;
+  if(seg->refs > 0) return;
+  seg->next = segfree[npkt];
+  segfree[npkt] = seg;
+}
+
+aldl_data_t record_get(aldl_conf_t *aldl, aldl_record_t *rec, int n) {
+  aldl_define_t *def = &aldl->def[n];
+  aldl_segment_t *seg = rec->seg[def->packet];
+  aldl_data_t v;
+  unsigned int tag, bits;
+  unsigned long long entry, *memo;
+  aldl_seq_t seq;
+  if(def->expr != NULL) return rec->derived[def->slot];
+  if(seg->raw == NULL) {
+    if(def->type != ALDL_BOOL) return seg->data[def->slot];
+    v.i = seg->bits[def->slot / ALDL_BITS_WORD] >>
+          ( def->slot % ALDL_BITS_WORD ) & 1;
+    return v;
+  }
+  memo = &seg->memo[n % RECORD_MEMO];
+  seq = rf_atomic_get(&seg->seq);
+  tag = (unsigned int)( seq * aldl->n_defs + n );
+  entry = __atomic_load_n(memo,__ATOMIC_RELAXED);
+  if(seq != 0 && (unsigned int)( entry >> 32 ) == tag) {
+    bits = (unsigned int)entry;
+    memcpy(&v,&bits,sizeof(v));
+    return v;
+  }
+  v = aldl_decode_def(aldl,n,seg->raw);
+  /* only cache it if the segment wasn't reused while decoding, or the entry
+     could hold old bytes under the new seq */
+  rf_fence_read();
+  if(seq == 0 || __atomic_load_n(&seg->seq,__ATOMIC_RELAXED) != seq) return v;
+  memcpy(&bits,&v,sizeof(v));
+  __atomic_store_n(memo,( (unsigned long long)tag << 32 ) | bits,
+                   __ATOMIC_RELAXED);
+  return v;
+}
+
+float record_float(aldl_conf_t *aldl, aldl_record_t *rec, int n) {
+  return record_get(aldl,rec,n).f;
+}
+
+int record_int(aldl_conf_t *aldl, aldl_record_t *rec, int n) {
+  return record_get(aldl,rec,n).i;
 }
 
-aldl_data_t *aldl_parse_def(aldl_conf_t *aldl, aldl_record_t *r, int n) {
+void record_decode(aldl_conf_t *aldl, aldl_record_t *rec, aldl_data_t *out) {
+  int npkt, x;
+  aldl_packetdef_t *pkt;
+  aldl_segment_t *seg;
+  aldl_data_t *values;
+  aldl_bits_t *bits;
+  for(npkt=0;npkt<aldl->comm->n_packets;npkt++) {
+    pkt = &aldl->comm->packet[npkt];
+    seg = rec->seg[npkt];
+    aldl_data_t local[pkt->n_defs + 1];
+    aldl_bits_t localbits[ALDL_BITS_WORDS(pkt->n_bits) + 1];
+    if(seg->raw != NULL) {
+      aldl_decode_raw(aldl,npkt,seg->raw,local,localbits);
+      values = local;
+      bits = localbits;
+    } else {
+      values = seg->data;
+      bits = seg->bits;
+    }
+    for(x=0;x<pkt->n_defs;x++) out[pkt->defs[x]] = values[x];
+    for(x=0;x<pkt->n_bits;x++) {
+      out[pkt->bitdefs[x]].i = bits[x / ALDL_BITS_WORD] >>
+                               ( x % ALDL_BITS_WORD ) & 1;
+    }
+  }
+  for(x=0;x<aldl->n_defs;x++) {
+    if(aldl->def[x].expr != NULL) out[x] = rec->derived[aldl->def[x].slot];
+  }
+}
+
+aldl_bits_t *record_bits(aldl_conf_t *aldl, aldl_record_t *rec, int npkt,
+                         aldl_bits_t *buf) {
+  aldl_segment_t *seg = rec->seg[npkt];
+  if(seg->raw == NULL) return seg->bits;
+  aldl_decode_bits(aldl,npkt,seg->raw,buf);
+  return buf;
+}
+
+int record_flag_count(aldl_conf_t *aldl, aldl_record_t *rec,
+                      aldl_flags_t which) {
+  return record_flag_changed(aldl,rec,NULL,which);
+}
+
+int record_flag_any(aldl_conf_t *aldl, aldl_record_t *rec,
+                    aldl_flags_t which) {
+  return record_flag_next(aldl,rec,which,-1) != -1;
+}
+
+int record_flag_next(aldl_conf_t *aldl, aldl_record_t *rec,
+                     aldl_flags_t which, int n) {
+  return record_flag_next_change(aldl,rec,NULL,which,n);
+}
+
+int record_flag_changed(aldl_conf_t *aldl, aldl_record_t *rec,
+                        aldl_record_t *prev, aldl_flags_t which) {
+  int npkt, w, words, count = 0;
+  aldl_packetdef_t *pkt;
+  aldl_bits_t *a, *b, x;
+  for(npkt=0;npkt<aldl->comm->n_packets;npkt++) {
+    pkt = &aldl->comm->packet[npkt];
+    if(pkt->n_bits == 0) continue;
+    /* a shared segment can't have changed */
+    if(prev != NULL && prev->seg[npkt] == rec->seg[npkt]) continue;
+    words = ALDL_BITS_WORDS(pkt->n_bits);
+    aldl_bits_t abuf[words], bbuf[words];
+    a = record_bits(aldl,rec,npkt,abuf);
+    b = prev != NULL ? record_bits(aldl,prev,npkt,bbuf) : NULL;
+    for(w=0;w<words;w++) {
+      x = b != NULL ? a[w] ^ b[w] : a[w];
+      if(which == ALDL_FLAGS_ERR) x &= pkt->errmask[w];
+      count += __builtin_popcountl(x);
+    }
+  }
+  return count;
+}
+
+int record_flag_next_change(aldl_conf_t *aldl, aldl_record_t *rec,
+                            aldl_record_t *prev, aldl_flags_t which, int n) {
+  int npkt = 0, bit = 0, w, words;
+  aldl_packetdef_t *pkt;
+  aldl_bits_t *a, *b, x;
+  if(n >= 0) { /* resume after definition n */
+    npkt = aldl->def[n].packet;
+    bit = aldl->def[n].slot + 1;
+  }
+  for(;npkt<aldl->comm->n_packets;npkt++, bit=0) {
+    pkt = &aldl->comm->packet[npkt];
+    if(bit >= pkt->n_bits) continue;
+    if(prev != NULL && prev->seg[npkt] == rec->seg[npkt]) continue;
+    words = ALDL_BITS_WORDS(pkt->n_bits);
+    aldl_bits_t abuf[words], bbuf[words];
+    a = record_bits(aldl,rec,npkt,abuf);
+    b = prev != NULL ? record_bits(aldl,prev,npkt,bbuf) : NULL;
+    for(w=bit/ALDL_BITS_WORD;w<words;w++) {
+      x = b != NULL ? a[w] ^ b[w] : a[w];
+      if(which == ALDL_FLAGS_ERR) x &= pkt->errmask[w];
+      if(w == bit / ALDL_BITS_WORD) {
+        x &= ~(aldl_bits_t)0 << ( bit % ALDL_BITS_WORD );
+      }
+      if(x != 0) return pkt->bitdefs[w * ALDL_BITS_WORD + __builtin_ctzl(x)];
+    }
+  }
+  return -1;
+}
+
+unsigned long record_time(aldl_conf_t *aldl, aldl_record_t *rec, int n) {
+  if(aldl->def[n].expr != NULL) return rec->t;
+  return rec->pktt[aldl->def[n].packet];
+}
+
+aldl_data_t *aldl_parse_def(aldl_conf_t *aldl, aldl_data_t *values, int n) {
   /* check for out of range */
   if(n < 0 || n > aldl->n_defs - 1) error(1,ERROR_RANGE,
                                     "def number %i is out of range",n); 
 
   aldl_define_t *def = &aldl->def[n]; /* shortcut to definition */
 
+  if(def->expr != NULL) return &values[n]; /* not from a packet */
+
   int id = def->packet; /* packet id (array index) */
 
   aldl_packetdef_t *pkt = &aldl->comm->packet[id]; /* ptr to packet */
@@ -174,7 +732,7 @@ aldl_data_t *aldl_parse_def(aldl_conf_t *aldl, aldl_record_t *r, int n) {
   byte *data = pkt->data + def->offset + pkt->offset;
 
   /* location for output of data, matches definition array index ... */
-  aldl_data_t *out = &r->data[n];
+  aldl_data_t *out = &values[n];
 
   /* location for input of data */
   unsigned int x;
@@ -193,13 +751,21 @@ aldl_data_t *aldl_parse_def(aldl_conf_t *aldl, aldl_record_t *r, int n) {
   /* apply any math or whatever and output as desired type */
   switch(def->type) {
     case ALDL_INT:
-      out->i = ( (int)x * def->multiplier.i ) + def->adder.i;
+      if(def->table != NULL) { /* always an 8 bit input */
+        out->i = def->table[x].i;
+      } else {
+        out->i = ( (int)x * def->multiplier.i ) + def->adder.i;
+      }
       if(aldl->minmax == 1) {
         out->i = rf_clamp_int(def->min.i,def->max.i,out->i);
       }
       break;
     case ALDL_FLOAT:
-      out->f = ( (float)x * def->multiplier.f ) + def->adder.f;
+      if(def->table != NULL) {
+        out->f = def->table[x].f;
+      } else {
+        out->f = ( (float)x * def->multiplier.f ) + def->adder.f;
+      }
       if(aldl->minmax == 1) {
         out->f = rf_clamp_float(def->min.f,def->max.f,out->f); 
       }
@@ -219,103 +785,264 @@ aldl_data_t *aldl_parse_def(aldl_conf_t *aldl, aldl_record_t *r, int n) {
 }
 
 aldl_state_t get_connstate(aldl_conf_t *aldl) {
-  set_lock(LOCK_CONNSTATE);
-  aldl_state_t st = aldl->state;
-  unset_lock(LOCK_CONNSTATE);
-  return st;
+  return rf_atomic_get(&aldl->state);
 }
 
 void set_connstate(aldl_state_t s, aldl_conf_t *aldl) {
   set_lock(LOCK_CONNSTATE);
+  aldl_state_t prev = aldl->state;
+  if(prev == s && statecount > 0) { /* not a transition */
+    unset_lock(LOCK_CONNSTATE);
+    return;
+  }
   #ifdef DEBUGSTRUCT
   printf("set connection state to %i (%s)\n",s,get_state_string(s));
   #endif
-  aldl->state = s;
+  aldl_state_event_t *ev = &statehist[( statecount + 1 ) % ALDL_STATEHIST];
+  ev->seq = statecount + 1;
+  ev->state = s;
+  ev->prev = statecount > 0 ? prev : s;
+  ev->t = get_elapsed_ms(statebase);
+  rf_atomic_set(&aldl->state,s);
+  rf_atomic_set(&statecount,ev->seq);
+  unset_lock(LOCK_CONNSTATE);
+  /* record waiters give up when the connection drops, so they're told too */
+  aldl_notify(aldl,NOTIFY_STATE | NOTIFY_RECORD);
+}
+
+void set_ready(aldl_conf_t *aldl, int ready) {
+  rf_atomic_set(&aldl->ready,ready);
+  aldl_notify(aldl,NOTIFY_STATE);
+}
+
+unsigned long copy_state_event(unsigned long last, aldl_state_event_t *ev) {
+  unsigned long want = last + 1;
+  if(statecount == 0) return 0;
+  if(want > statecount) want = statecount;
+  if(statecount >= ALDL_STATEHIST && want <= statecount - ALDL_STATEHIST) {
+    want = statecount - ALDL_STATEHIST + 1; /* fell out of the history */
+  }
+  *ev = statehist[want % ALDL_STATEHIST];
+  return want;
+}
+
+unsigned long get_state_event(aldl_conf_t *aldl, aldl_state_event_t *ev) {
+  unsigned long seq;
+  set_lock(LOCK_CONNSTATE);
+  seq = copy_state_event(statecount - 1,ev);
+  unset_lock(LOCK_CONNSTATE);
+  return seq;
+}
+
+unsigned long wait_state_event(aldl_conf_t *aldl, unsigned long last,
+                               aldl_state_event_t *ev, int timeout) {
+  struct timespec deadline;
+  unsigned long seq = 0;
+  if(timeout > 0) aldl_deadline(&deadline,timeout);
+  aldl_wait_enter(WAIT_STATE);
+  while(rf_atomic_get(&statecount) <= last) {
+    if(aldl_wait_sleep_until(aldl,WAIT_STATE,
+                             timeout > 0 ? &deadline : NULL) == 1) {
+      break;
+    }
+  }
+  aldl_wait_leave(WAIT_STATE);
+  set_lock(LOCK_CONNSTATE);
+  if(statecount > last) seq = copy_state_event(last,ev);
   unset_lock(LOCK_CONNSTATE);
+  return seq;
 }
 
 aldl_record_t *newest_record(aldl_conf_t *aldl) {
-  aldl_record_t *rec = NULL;
-  set_lock(LOCK_RECORDPTR);
-  rec = aldl->r; 
-  unset_lock(LOCK_RECORDPTR);
-  return rec;
+  return rf_atomic_get(&aldl->r);
+}
+
+aldl_seq_t record_seq(aldl_record_t *rec) {
+  return rf_atomic_get(&rec->seq);
+}
+
+int record_valid(aldl_record_t *rec, aldl_seq_t seq) {
+  /* make sure the data reads happen before the check */
+  rf_fence_read();
+  if(seq == 0 || __atomic_load_n(&rec->seq,__ATOMIC_RELAXED) != seq) return 0;
+  return 1;
 }
 
 aldl_record_t *newest_record_wait(aldl_conf_t *aldl, aldl_record_t *rec) {
   aldl_record_t *next = NULL;
+  aldl_wait_enter(WAIT_RECORD);
   while(1) {
     next = newest_record(aldl);
-    if(next != rec) {
-      return next;
-    } else if(get_connstate(aldl) > 10) {
-      return NULL;
-    } else {
-      #ifndef AGGRESSIVE
-      usleep(500);
-      #endif
+    if(next != rec) break;
+    if(get_connstate(aldl) > 10) {
+      next = NULL;
+      break;
     }
-  } 
+    aldl_wait_sleep(aldl,WAIT_RECORD);
+  }
+  aldl_wait_leave(WAIT_RECORD);
+  return next;
 }
 
 aldl_record_t *next_record_wait(aldl_conf_t *aldl, aldl_record_t *rec) {
   aldl_record_t *next = NULL;
-  while(next == NULL) {
+  aldl_wait_enter(WAIT_RECORD);
+  while(1) {
+    if(get_connstate(aldl) > 10) {
+      next = NULL;
+      break;
+    }
     next = next_record(rec);
-    if(get_connstate(aldl) > 10) return NULL;
-    #ifndef AGGRESSIVE
-    usleep(500); /* throttling ... */
-    #endif
+    if(next != NULL) break;
+    aldl_wait_sleep(aldl,WAIT_RECORD);
   }
+  aldl_wait_leave(WAIT_RECORD);
   return next;
 }
 
 aldl_record_t *next_record_waitf(aldl_conf_t *aldl, aldl_record_t *rec) {
   aldl_record_t *next = NULL;
-  while((next = next_record_wait(aldl,rec)) == NULL) usleep(500);
+  while((next = next_record_wait(aldl,rec)) == NULL) {
+    pause_until_connected(aldl);
+  }
   return next;
 }
 
 aldl_record_t *newest_record_waitf(aldl_conf_t *aldl, aldl_record_t *rec) {
   aldl_record_t *next = NULL;
-  while((next = newest_record_wait(aldl,rec)) == NULL) usleep(500);
+  while((next = newest_record_wait(aldl,rec)) == NULL) {
+    pause_until_connected(aldl);
+  }
   return next;
 }
 
 aldl_record_t *next_record(aldl_record_t *rec) {
-  #ifdef DEBUGSTRUCT
-  /* check for underrun ... */
-  if(rec->prev == NULL) {
-     error(1,ERROR_BUFFER,"underrun in record retrieve %p",rec);
+  aldl_seq_t seq = record_seq(rec);
+  aldl_seq_t head;
+  aldl_record_t *next;
+  aldl_seq_t nextseq;
+  if(seq != 0) {
+    next = &recordbuffer[( seq + 1 ) % ringsize];
+    nextseq = record_seq(next);
+    if(nextseq == seq + 1) return next;
+    if(nextseq < seq + 1) return NULL; /* not there yet */
   }
+  /* rec was overwritten, point at the oldest record that isn't about to be.
+     the data will be out of sequence but technically valid. */
+  #ifdef DEBUGSTRUCT
+  error(0,ERROR_BUFFER,"underrun in record retrieve %p",rec);
   #endif
-  aldl_record_t *next;
-  set_lock(LOCK_RECORDPTR);
-  next = rec->next;
-  unset_lock(LOCK_RECORDPTR);
+  head = rf_atomic_get(&headseq);
+  seq = head > ringsize - 2 ? head - ringsize + 2 : 1;
+  next = &recordbuffer[seq % ringsize];
+  if(record_seq(next) != seq) return NULL;
   return next;
 }
 
-void pause_until_connected(aldl_conf_t *aldl) {
-  while(get_connstate(aldl) > 10) {
-    #ifdef AGGRESSIVE
-      usleep(100);
-    #else
-      msleep(100);
-    #endif
+aldl_record_t *prev_record(aldl_record_t *rec) {
+  aldl_seq_t seq = record_seq(rec);
+  if(seq < 2) return NULL;
+  aldl_record_t *prev = &recordbuffer[( seq - 1 ) % ringsize];
+  if(record_seq(prev) != seq - 1) return NULL;
+  return prev;
+}
+
+int history_float(aldl_conf_t *aldl, int n, aldl_seq_t *first, int max,
+                  float *out, unsigned long *t) {
+  return history_copy(aldl,n,first,max,out,0,t);
+}
+
+int history_int(aldl_conf_t *aldl, int n, aldl_seq_t *first, int max,
+                int *out, unsigned long *t) {
+  return history_copy(aldl,n,first,max,out,1,t);
+}
+
+int history_copy(aldl_conf_t *aldl, int n, aldl_seq_t *first, int max,
+                 void *out, int isint, unsigned long *t) {
+  aldl_seq_t head, oldest, seq;
+  aldl_data_t *col;
+  float *outf = out;
+  int *outi = out;
+  int count, x, y, slot, run, drop;
+
+  if(n < 0 || n > aldl->n_defs - 1 || histslot[n] == -1) return -1;
+  col = &histbuffer[histslot[n] * ringsize];
+
+  /* the range, leaving out the slot that's next to be overwritten */
+  head = rf_atomic_get(&headseq);
+  oldest = head > ringsize - 2 ? head - ringsize + 2 : 1;
+  seq = *first;
+  if(seq == 0) seq = head > (aldl_seq_t)max ? head - max + 1 : 1;
+  if(seq < oldest) seq = oldest;
+  if(head < seq || max < 1) {
+    *first = seq;
+    return 0;
   }
+  count = head - seq + 1 > (aldl_seq_t)max ? max : head - seq + 1;
+
+  /* copied in at most two runs, one either side of the end of the ring */
+  for(x=0;x<count;x+=run) {
+    slot = ( seq + x ) % ringsize;
+    run = count - x < (int)ringsize - slot ? count - x : (int)ringsize - slot;
+    if(isint == 1) {
+      for(y=0;y<run;y++) outi[x + y] = col[slot + y].i;
+    } else {
+      for(y=0;y<run;y++) outf[x + y] = col[slot + y].f;
+    }
+    if(t != NULL) memcpy(&t[x],&histtime[slot],sizeof(unsigned long) * run);
+  }
+
+  /* records are overwritten oldest first, so any that were while copying
+     are at the start.  drop those. */
+  rf_fence_read();
+  for(drop=0;drop<count;drop++) {
+    if(__atomic_load_n(&recordbuffer[( seq + drop ) % ringsize].seq,
+                       __ATOMIC_RELAXED) == seq + drop) break;
+  }
+  if(drop > 0) {
+    count -= drop;
+    memmove(out,(int *)out + drop,sizeof(int) * count);
+    if(t != NULL) memmove(t,t + drop,sizeof(unsigned long) * count);
+    seq += drop;
+  }
+  *first = seq;
+  return count;
 }
 
-void pause_until_buffered(aldl_conf_t *aldl) {
-  while(aldl->ready ==0) {
-    #ifdef AGGRESSIVE
-      usleep(100);
-    #else
-      msleep(100); 
-    #endif
+aldl_seq_t history_seq(aldl_conf_t *aldl, unsigned long t) {
+  aldl_seq_t head, lo, hi, mid;
+  while(1) {
+    head = rf_atomic_get(&headseq);
+    if(head == 0) return 0;
+    lo = head > ringsize - 2 ? head - ringsize + 2 : 1;
+    if(histtime[head % ringsize] < t) return 0; /* nothing that late yet */
+    /* the first record at or after t, times only go forward */
+    hi = head;
+    while(lo < hi) {
+      mid = lo + ( hi - lo ) / 2;
+      if(histtime[mid % ringsize] < t) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    /* if it was overwritten while searching, search again */
+    if(record_valid(&recordbuffer[lo % ringsize],lo) == 1) return lo;
   }
 }
 
+void pause_until_connected(aldl_conf_t *aldl) {
+  aldl_wait_enter(WAIT_STATE);
+  while(get_connstate(aldl) > 10) aldl_wait_sleep(aldl,WAIT_STATE);
+  aldl_wait_leave(WAIT_STATE);
+}
+
+void pause_until_buffered(aldl_conf_t *aldl) {
+  aldl_wait_enter(WAIT_STATE);
+  while(rf_atomic_get(&aldl->ready) == 0) aldl_wait_sleep(aldl,WAIT_STATE);
+  aldl_wait_leave(WAIT_STATE);
+}
+
 int get_index_by_name(aldl_conf_t *aldl, char *name) {
   int x;
   for(x=0;x<aldl->n_defs;x++) {
@@ -350,58 +1077,280 @@ char *get_state_string(aldl_state_t s) {
 }
 
 void aldl_alloc_pool(aldl_conf_t *aldl) {
+  int x;
+  int n_packets = aldl->comm->n_packets;
+
   /* get sizes */
-  size_t databuffer_size = sizeof(aldl_data_t) * aldl->n_defs * aldl->bufsize;
+  size_t segbuffer_size = sizeof(aldl_segment_t *) * n_packets * aldl->bufsize;
+  size_t pkttbuffer_size = sizeof(unsigned long) * n_packets * aldl->bufsize;
   size_t recordbuffer_size = sizeof(aldl_record_t) * aldl->bufsize;
+  size_t derivedbuffer_size = sizeof(aldl_data_t) * ( aldl->n_derived + 1 ) *
+                              aldl->bufsize;
+  size_t aggbuffer_size = sizeof(aldl_aggregate_t) *
+                     ( aldl->n_stats * aldl->n_windows + 1 ) * aldl->bufsize;
 
   /* alloc */
-  databuffer = smalloc(databuffer_size);
+  segbuffer = smalloc(segbuffer_size);
   recordbuffer = smalloc(recordbuffer_size);
-  indexbuffer = 0; /* start at ptr 0 */
+  segfree = smalloc(sizeof(aldl_segment_t *) * n_packets);
+  segnew = smalloc(sizeof(aldl_segment_t *) * n_packets);
+  segnewt = smalloc(sizeof(unsigned long) * n_packets);
+  segseen = smalloc(sizeof(int) * n_packets);
+  pkttbuffer = smalloc(pkttbuffer_size);
+  derivedbuffer = smalloc(derivedbuffer_size);
+  aggbuffer = smalloc(aggbuffer_size);
+  ringsize = aldl->bufsize;
+  headseq = 0; /* nothing published */
+  segseq = 0;
+
+  /* each slot owns a fixed piece of the segment pointer and time pools */
+  memset(segbuffer,0,segbuffer_size);
+  memset(pkttbuffer,0,pkttbuffer_size);
+  memset(derivedbuffer,0,derivedbuffer_size);
+  memset(aggbuffer,0,aggbuffer_size); /* the first record has no stats */
+  for(x=0;x<ringsize;x++) {
+    recordbuffer[x].seq = 0;
+    recordbuffer[x].t = 0;
+    recordbuffer[x].seg = &segbuffer[x * n_packets];
+    recordbuffer[x].pktt = &pkttbuffer[x * n_packets];
+    recordbuffer[x].derived = &derivedbuffer[x * ( aldl->n_derived + 1 )];
+    recordbuffer[x].agg = &aggbuffer[x *
+                               ( aldl->n_stats * aldl->n_windows + 1 )];
+  }
+
+  /* segments are added as needed, start each packet with one lot */
+  for(x=0;x<n_packets;x++) {
+    segfree[x] = NULL;
+    segnew[x] = NULL;
+    segseen[x] = 0;
+    segment_grow(aldl,x);
+  }
+
+  aldl_alloc_history(aldl);
 
   /* optional print sizes */
   #ifdef DEBUGMEM
-  printf("aldldata.c Circular Buffer: BUF=%u Recs, DATA=%uKb REC=%uKb\n",
-          aldl->bufsize, (unsigned int)databuffer_size/1024,
-         (unsigned int)recordbuffer_size/1024);
+  printf("aldldata.c Circular Buffer: BUF=%u Recs, SEG=%uKb REC=%uKb%s\n",
+          aldl->bufsize, (unsigned int)segbuffer_size/1024,
+         (unsigned int)recordbuffer_size/1024,
+         aldl->rawrecords == 1 ? " (raw)" : "");
+  #endif
+}
+
+void aldl_alloc_history(aldl_conf_t *aldl) {
+  int x;
+  histslot = smalloc(sizeof(int) * ( aldl->n_defs + 1 ));
+  histdefs = smalloc(sizeof(int) * ( aldl->n_defs + 1 ));
+  n_hist = 0;
+  for(x=0;x<aldl->n_defs;x++) {
+    histslot[x] = -1;
+    if(aldl->def[x].history == 0) continue;
+    histslot[x] = n_hist;
+    histdefs[n_hist] = x;
+    n_hist++;
+  }
+  histbuffer = smalloc(sizeof(aldl_data_t) * ( n_hist + 1 ) * ringsize);
+  histtime = smalloc(sizeof(unsigned long) * ringsize);
+  memset(histbuffer,0,sizeof(aldl_data_t) * ( n_hist + 1 ) * ringsize);
+  memset(histtime,0,sizeof(unsigned long) * ringsize);
+  #ifdef DEBUGMEM
+  printf("history store: %i columns, %uKb\n",n_hist,
+     (unsigned int)( ( sizeof(aldl_data_t) * n_hist + sizeof(unsigned long) ) *
+                     ringsize / 1024 ));
   #endif
 }
 
+void history_store(aldl_conf_t *aldl, aldl_record_t *rec) {
+  int x;
+  int slot = rec - recordbuffer;
+  for(x=0;x<n_hist;x++) {
+    histbuffer[x * ringsize + slot] = record_get(aldl,rec,histdefs[x]);
+  }
+  histtime[slot] = rec->t;
+}
+
+void aldl_alloc_comq() {
+  int pri, x;
+  comslot = smalloc(sizeof(cmdslot_t) * AUXCOMMAND_KEYS);
+  memset(comslot,0,sizeof(cmdslot_t) * AUXCOMMAND_KEYS);
+  comq = smalloc(sizeof(cmdqueue_t) * ALDL_CMD_PRIORITIES);
+  for(pri=0;pri<ALDL_CMD_PRIORITIES;pri++) {
+    comq[pri].head = 0;
+    comq[pri].tail = 0;
+    for(x=0;x<AUXCOMMAND_QUEUESIZE;x++) comq[pri].slot[x].seq = x;
+  }
+}
+
+int aldl_queue_command(byte *command, byte length, int delay,
+                       aldl_cmdpri_t pri, aldl_cmdresult_t *result) {
+  if(command == NULL) return 0;
+  if(length > ALDL_CMDMAX) error(1,ERROR_RANGE,
+               "aux command length %i exceeds max %i",length,ALDL_CMDMAX);
+  if(pri < 0 || pri >= ALDL_CMD_PRIORITIES) pri = ALDL_CMD_NORMAL;
+
+  cmdqueue_t *q = &comq[pri];
+  aldl_comq_t *c;
+  unsigned long pos = __atomic_load_n(&q->tail,__ATOMIC_RELAXED);
+  long diff;
+
+  /* claim a slot */
+  while(1) {
+    c = &q->slot[pos % AUXCOMMAND_QUEUESIZE];
+    diff = (long)rf_atomic_get(&c->seq) - (long)pos;
+    if(diff == 0) {
+      if(__atomic_compare_exchange_n(&q->tail,&pos,pos + 1,1,
+                                     __ATOMIC_RELAXED,__ATOMIC_RELAXED)) break;
+    } else if(diff < 0) { /* full */
+      /* final before this returns, and it was never queued, so nobody else
+         can be waiting for it and there's no one to notify */
+      if(result != NULL) {
+        rf_atomic_set(&result->status,ALDL_CMD_DROPPED);
+        if(result->callback != NULL) result->callback(result,result->arg);
+      }
+      return 0;
+    } else {
+      pos = __atomic_load_n(&q->tail,__ATOMIC_RELAXED);
+    }
+  }
+
+  /* fill and hand it to the consumer */
+  memcpy(c->command,command,length);
+  c->length = length;
+  c->delay = delay;
+  c->result = result;
+  if(result != NULL) {
+    result->replylen = 0;
+    rf_atomic_set(&result->status,ALDL_CMD_QUEUED);
+  }
+  rf_atomic_set(&c->seq,pos + 1);
+  return 1;
+}
+
 void aldl_add_command(byte *command, byte length, int delay) {
-  if(command == NULL) return;
-
-  /* build new command */
-  aldl_comq_t *n; /* new command */
-  n = smalloc(sizeof(aldl_comq_t));
-  n->length = length;
-  n->delay = delay;
-  n->command = smalloc(sizeof(char) * length);
-  int x; for(x=0;x<length;x++) { /* copy command */
-    n->command[x] = command[x];
-  }
-  n->next = NULL;
-
-  /* link in new command */
-  set_lock(LOCK_COMQ);
-  if(comq == NULL) { /* no other commands exist */
-    comq = n;
-  } else {
-    aldl_comq_t *e = comq; /* end of linked list */
-    while(e->next != NULL) e = e->next; /* seek end */
-    e->next = n; 
-  } 
-  unset_lock(LOCK_COMQ);
-}
-
-aldl_comq_t *aldl_get_command() {
-  set_lock(LOCK_COMQ);
-  if(comq == NULL) {
-    unset_lock(LOCK_COMQ);
-    return NULL; /* no command available */
-  }
-  aldl_comq_t *c = comq;
-  comq = c->next; /* advance to next command */
-  unset_lock(LOCK_COMQ);
-  return c;
-  /* WARNING you need to free this after you're done with it ... */
+  aldl_queue_command(command,length,delay,ALDL_CMD_NORMAL,NULL);
+}
+
+int aldl_post_command(aldl_conf_t *aldl, int key, byte *command, byte length,
+                      int delay, aldl_cmdresult_t *result) {
+  if(command == NULL) return 0;
+  if(key < 0 || key >= AUXCOMMAND_KEYS) error(1,ERROR_RANGE,
+               "aux command key %i out of range",key);
+  if(length > ALDL_CMDMAX) error(1,ERROR_RANGE,
+               "aux command length %i exceeds max %i",length,ALDL_CMDMAX);
+  cmdslot_t *k = &comslot[key];
+  aldl_cmdresult_t *old;
+  unsigned long seq;
+
+  while(__atomic_exchange_n(&k->busy,1,__ATOMIC_ACQUIRE) == 1) sched_yield();
+  old = k->c.result;
+
+  /* rewrite the slot under the seqlock */
+  seq = k->seq + 1;
+  __atomic_store_n(&k->seq,seq,__ATOMIC_RELAXED);
+  rf_fence_write();
+  memcpy(k->c.command,command,length);
+  k->c.length = length;
+  k->c.delay = delay;
+  k->c.result = result;
+  if(result != NULL) {
+    result->replylen = 0;
+    rf_atomic_set(&result->status,ALDL_CMD_QUEUED);
+  }
+  seq++;
+  rf_atomic_set(&k->seq,seq);
+
+  /* make it the pending one; if the last one was still pending, it lost */
+  int replaced = __atomic_exchange_n(&k->pending,seq,__ATOMIC_ACQ_REL) != 0;
+  __atomic_store_n(&k->busy,0,__ATOMIC_RELEASE);
+
+  if(replaced == 1 && old != NULL && old != result) {
+    rf_atomic_set(&old->status,ALDL_CMD_REPLACED);
+    if(old->callback != NULL) old->callback(old,old->arg);
+    aldl_notify(aldl,NOTIFY_COMMAND);
+  }
+  return replaced;
+}
+
+int aldl_get_command(aldl_comq_t *c) {
+  int pri, key;
+  cmdqueue_t *q;
+  aldl_comq_t *slot;
+  unsigned long pos;
+  long diff;
+  cmdslot_t *k;
+
+  /* keyed commands first, take the latest by its exact seq */
+  for(key=0;key<AUXCOMMAND_KEYS;key++) {
+    k = &comslot[key];
+    while((pos = rf_atomic_get(&k->pending)) != 0) {
+      *c = k->c;
+      rf_fence_read();
+      /* torn, a poster is mid-write.  don't wait on it, it's taken on a
+         later pass */
+      if(__atomic_load_n(&k->seq,__ATOMIC_RELAXED) != pos) break;
+      if(__atomic_compare_exchange_n(&k->pending,&pos,0,0,
+                                     __ATOMIC_ACQ_REL,__ATOMIC_RELAXED)) {
+        return 1;
+      }
+    }
+  }
+
+  for(pri=0;pri<ALDL_CMD_PRIORITIES;pri++) {
+    q = &comq[pri];
+    pos = __atomic_load_n(&q->head,__ATOMIC_RELAXED);
+    while(1) {
+      slot = &q->slot[pos % AUXCOMMAND_QUEUESIZE];
+      diff = (long)rf_atomic_get(&slot->seq) - (long)( pos + 1 );
+      if(diff == 0) {
+        if(__atomic_compare_exchange_n(&q->head,&pos,pos + 1,1,
+                                     __ATOMIC_RELAXED,__ATOMIC_RELAXED)) break;
+      } else if(diff < 0) { /* empty */
+        break;
+      } else {
+        pos = __atomic_load_n(&q->head,__ATOMIC_RELAXED);
+      }
+    }
+    if(diff < 0) continue; /* try the next priority */
+
+    /* copy it out, then give the slot back to producers a lap later */
+    *c = *slot;
+    rf_atomic_set(&slot->seq,pos + AUXCOMMAND_QUEUESIZE);
+    return 1;
+  }
+  return 0; /* no command available */
+}
+
+void aldl_complete_command(aldl_conf_t *aldl, aldl_comq_t *c,
+                           aldl_cmdstatus_t status, byte *reply, int replylen) {
+  aldl_cmdresult_t *r = c->result;
+  if(r == NULL) return;
+  if(status >= ALDL_CMD_DONE && reply != NULL) {
+    if(replylen > ALDL_CMDMAX) replylen = ALDL_CMDMAX;
+    memcpy(r->reply,reply,replylen);
+    r->replylen = replylen;
+  }
+  rf_atomic_set(&r->status,status);
+  if(status < ALDL_CMD_DONE) return;
+  c->result = NULL; /* the owner may reuse it now */
+  if(r->callback != NULL) r->callback(r,r->arg);
+  aldl_notify(aldl,NOTIFY_COMMAND);
+}
+
+aldl_cmdstatus_t aldl_command_status(aldl_cmdresult_t *result) {
+  return rf_atomic_get(&result->status);
+}
+
+aldl_cmdstatus_t aldl_command_wait(aldl_conf_t *aldl, aldl_cmdresult_t *result,
+                                   int timeout) {
+  struct timespec deadline;
+  if(timeout > 0) aldl_deadline(&deadline,timeout);
+  aldl_wait_enter(WAIT_COMMAND);
+  while(aldl_command_status(result) < ALDL_CMD_DONE) {
+    if(aldl_wait_sleep_until(aldl,WAIT_COMMAND,
+                             timeout > 0 ? &deadline : NULL) == 1) {
+      break;
+    }
+  }
+  aldl_wait_leave(WAIT_COMMAND);
+  return aldl_command_status(result);
 }
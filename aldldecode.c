@@ -0,0 +1,783 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <math.h>
+
+#include "error.h"
+#include "config.h"
+#include "aldl-io.h"
+#include "useful.h"
+
+#ifdef DECODE_SIMD
+#if defined(__x86_64__) || defined(__i386__)
+#define DECODE_X86
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#define DECODE_NEON
+#include <arm_neon.h>
+#endif
+#endif
+
+/************ SCOPE *********************************
+  This object compiles data definitions into a
+  per-packet decode plan at load time, and decodes
+  packets with it.  aldl_parse_def in aldldata.c is
+  the reference the plan must match exactly.
+****************************************************/
+
+/* number of records to decode each way in aldl_decode_bench, split into
+   passes so the best one can be taken; the box is rarely quiet */
+#define DECODE_BENCH_RECORDS 200000
+#define DECODE_BENCH_PASSES 10
+
+/* rounds of random data the startup self-check decodes */
+#define DECODE_SELFTEST_ROUNDS 64
+
+/* a kernel that decodes a float group, wide is set for 16 bit fields */
+typedef void (*decode_float_fn)(aldl_decodegroup_t *g, byte *data,
+                                aldl_data_t *out, int wide);
+
+/* where each definition sits in its packet's plan, for decoding just one */
+typedef struct _decode_where {
+  aldl_decodekind_t kind;
+  int index; /* element of the group */
+} decode_where_t;
+decode_where_t *defwhere;
+
+/* the float kernel in use, and its name */
+decode_float_fn decode_float;
+char *decode_float_name;
+
+/* the generated decoder, if one was linked in and matches the definitions,
+   which replaces the whole plan */
+void (*decode_gen)(int npkt, byte *data, aldl_data_t *out, aldl_bits_t *bits);
+
+/* --------- local function decl. ---------------- */
+
+/* float kernels.  all of them do the multiply and add as separate roundings
+   (no fma), and clamp with compares, so they match aldl_parse_def bit for
+   bit.  the vector ones only exist if DECODE_SIMD is set and the compiler
+   targets that architecture. */
+void decode_float_scalar(aldl_decodegroup_t *g, byte *data, aldl_data_t *out,
+                         int wide);
+#ifdef DECODE_X86
+void decode_float_sse2(aldl_decodegroup_t *g, byte *data, aldl_data_t *out,
+                       int wide);
+void decode_float_avx2(aldl_decodegroup_t *g, byte *data, aldl_data_t *out,
+                       int wide);
+#endif
+#ifdef DECODE_NEON
+void decode_float_neon(aldl_decodegroup_t *g, byte *data, aldl_data_t *out,
+                       int wide);
+#endif
+
+/* pick the fastest float kernel the cpu supports */
+void decode_select_kernel();
+
+/* the raw value of the field at offset */
+inline int decode_field(byte *data, int offset, int wide);
+
+/* 1 if the n outputs from first are adjacent in the record, so a vector can
+   be stored whole.  out is strictly increasing, so the ends are enough. */
+inline int decode_is_run(aldl_decodegroup_t *g, int first, int n);
+
+/* the scalar float loop, from first to the end of the group, which is also
+   the tail of every vector kernel */
+inline void decode_float_range(aldl_decodegroup_t *g, byte *data,
+                               aldl_data_t *out, int wide, int first);
+
+/* compare the plan to aldl_parse_def on random packets, 1 if identical */
+int decode_check(aldl_conf_t *aldl, int rounds);
+
+/* the name of what aldl_decode_raw is using, for messages */
+char *decode_name();
+
+/* fold len bytes at p into an fnv-1a hash */
+unsigned long long decode_hash(unsigned long long h, void *p, size_t len);
+
+/* time DECODE_BENCH_RECORDS records through the plan, in microseconds, as
+   the best pass scaled up.  every packet is decoded into out and bits,
+   which must hold the slots and bits of the largest one. */
+unsigned long decode_time(aldl_conf_t *aldl, aldl_data_t *out,
+                          aldl_bits_t *bits);
+
+/* which group of the plan a definition belongs to */
+aldl_decodekind_t decode_kind(aldl_conf_t *aldl, aldl_define_t *def);
+
+/* fill in the clamped output of def for each value of an 8 bit field */
+void decode_table(aldl_conf_t *aldl, aldl_define_t *def, aldl_data_t *table);
+
+/* allocate the arrays of a group with room for count definitions */
+void decode_alloc_group(aldl_decodegroup_t *g, int count);
+
+/* --------------------------------------------------------- */
+
+aldl_decodekind_t decode_kind(aldl_conf_t *aldl, aldl_define_t *def) {
+  int wide = ( def->size == 16 ); /* anything else is read as 8 bit */
+  if(def->table != NULL) return ALDL_DECODE_TABLE8;
+  if(aldl->lookup == 1 && wide == 0 && def->type != ALDL_BOOL) {
+    return ALDL_DECODE_TABLE8;
+  }
+  switch(def->type) {
+    case ALDL_INT:
+      return wide ? ALDL_DECODE_INT16 : ALDL_DECODE_INT8;
+    case ALDL_FLOAT:
+      return wide ? ALDL_DECODE_FLOAT16 : ALDL_DECODE_FLOAT8;
+    case ALDL_BOOL:
+      return wide ? ALDL_DECODE_BOOL16 : ALDL_DECODE_BOOL8;
+    default:
+      error(1,ERROR_RANGE,"invalid type spec: %i",def->type);
+  }
+  return ALDL_DECODE_KINDS; /* not reached */
+}
+
+void decode_alloc_group(aldl_decodegroup_t *g, int count) {
+  g->count = 0;
+  if(count == 0) count = 1; /* keep the pointers valid */
+  g->offset = smalloc(sizeof(int) * count);
+  g->out = smalloc(sizeof(int) * count);
+  g->mul = smalloc(sizeof(aldl_data_t) * count);
+  g->add = smalloc(sizeof(aldl_data_t) * count);
+  g->min = smalloc(sizeof(aldl_data_t) * count);
+  g->max = smalloc(sizeof(aldl_data_t) * count);
+  g->shift = smalloc(sizeof(int) * count);
+  g->invert = smalloc(sizeof(int) * count);
+  g->table = NULL;
+}
+
+void decode_table(aldl_conf_t *aldl, aldl_define_t *def, aldl_data_t *table) {
+  int v;
+  float f;
+  int i;
+  /* the same arithmetic as aldl_parse_def, so the results are identical */
+  for(v=0;v<ALDL_TABLE_SIZE;v++) {
+    if(def->type == ALDL_FLOAT) {
+      f = def->table != NULL ? def->table[v].f :
+          ( (float)v * def->multiplier.f ) + def->adder.f;
+      if(aldl->minmax == 1) f = rf_clamp_float(def->min.f,def->max.f,f);
+      table[v].f = f;
+    } else {
+      i = def->table != NULL ? def->table[v].i :
+          ( v * def->multiplier.i ) + def->adder.i;
+      if(aldl->minmax == 1) i = rf_clamp_int(def->min.i,def->max.i,i);
+      table[v].i = i;
+    }
+  }
+}
+
+void aldl_decode_compile(aldl_conf_t *aldl) {
+  int npkt, x, kind;
+  int counts[ALDL_DECODE_KINDS];
+  aldl_packetdef_t *pkt;
+  aldl_define_t *def;
+  aldl_decodegroup_t *g;
+  int n;
+
+  defwhere = smalloc(sizeof(decode_where_t) * aldl->n_defs);
+
+  for(npkt=0;npkt<aldl->comm->n_packets;npkt++) {
+    pkt = &aldl->comm->packet[npkt];
+
+    /* size each group, and give each definition a slot in the packet, or
+       a bit if it's a bool */
+    memset(counts,0,sizeof(counts));
+    pkt->n_defs = 0;
+    pkt->defs = smalloc(sizeof(int) * aldl->n_defs);
+    pkt->n_bits = 0;
+    pkt->bitdefs = smalloc(sizeof(int) * aldl->n_defs);
+    for(x=0;x<aldl->n_defs;x++) {
+      if(aldl->def[x].packet != npkt || aldl->def[x].expr != NULL) continue;
+      counts[decode_kind(aldl,&aldl->def[x])]++;
+      if(aldl->def[x].type == ALDL_BOOL) {
+        aldl->def[x].slot = pkt->n_bits;
+        pkt->bitdefs[pkt->n_bits] = x;
+        pkt->n_bits++;
+      } else {
+        aldl->def[x].slot = pkt->n_defs;
+        pkt->defs[pkt->n_defs] = x;
+        pkt->n_defs++;
+      }
+    }
+    pkt->errmask = smalloc(sizeof(aldl_bits_t) *
+                           ( ALDL_BITS_WORDS(pkt->n_bits) + 1 ));
+    memset(pkt->errmask,0,sizeof(aldl_bits_t) *
+                          ( ALDL_BITS_WORDS(pkt->n_bits) + 1 ));
+    for(x=0;x<pkt->n_bits;x++) {
+      if(aldl->def[pkt->bitdefs[x]].err == 1) {
+        pkt->errmask[x / ALDL_BITS_WORD] |= (aldl_bits_t)1 <<
+                                            ( x % ALDL_BITS_WORD );
+      }
+    }
+    pkt->plan = smalloc(sizeof(aldl_decodegroup_t) * ALDL_DECODE_KINDS);
+    for(kind=0;kind<ALDL_DECODE_KINDS;kind++) {
+      decode_alloc_group(&pkt->plan[kind],counts[kind]);
+    }
+    pkt->plan[ALDL_DECODE_TABLE8].table = smalloc(sizeof(aldl_data_t) *
+                     ALDL_TABLE_SIZE * ( counts[ALDL_DECODE_TABLE8] + 1 ));
+
+    /* fill them in definition order, resolving everything that doesn't
+       change per record now: packet header offset, clamp range (or none),
+       and bit position. */
+    for(x=0;x<aldl->n_defs;x++) {
+      def = &aldl->def[x];
+      if(def->packet != npkt || def->expr != NULL) continue;
+      g = &pkt->plan[decode_kind(aldl,def)];
+      n = g->count;
+      g->offset[n] = def->offset + pkt->offset;
+      if(g->offset[n] + ( def->size == 16 ? 1 : 0 ) >= pkt->length) {
+        error(1,ERROR_CONFIG,"def %s is past the end of packet %i",
+              def->name,npkt);
+      }
+      g->out[n] = def->slot;
+      g->mul[n] = def->multiplier;
+      g->add[n] = def->adder;
+      if(def->type == ALDL_FLOAT) {
+        g->min[n].f = aldl->minmax == 1 ? def->min.f : -INFINITY;
+        g->max[n].f = aldl->minmax == 1 ? def->max.f : INFINITY;
+      } else {
+        g->min[n].i = aldl->minmax == 1 ? def->min.i : INT_MIN;
+        g->max[n].i = aldl->minmax == 1 ? def->max.i : INT_MAX;
+      }
+      g->shift[n] = aldl->comm->byteorder == 1 ? 7 - def->binary :
+                                                 def->binary;
+      g->invert[n] = def->invert;
+      if(g->table != NULL) {
+        decode_table(aldl,def,&g->table[n * ALDL_TABLE_SIZE]);
+      }
+      defwhere[x].kind = decode_kind(aldl,def);
+      defwhere[x].index = n;
+      g->count++;
+    }
+  }
+
+  decode_select_kernel();
+
+  #ifdef DECODE_SELFTEST
+  /* a kernel that disagrees with the reference isn't used */
+  if(decode_check(aldl,DECODE_SELFTEST_ROUNDS) == 0) {
+    error(0,ERROR_RANGE,"%s decode kernel failed self-check, using scalar",
+          decode_float_name);
+    decode_float = decode_float_scalar;
+    decode_float_name = "scalar";
+    if(decode_check(aldl,DECODE_SELFTEST_ROUNDS) == 0) {
+      error(1,ERROR_RANGE,"decode plan does not match aldl_parse_def");
+    }
+  }
+  #endif
+
+  /* a generated decoder is only good for the layout it was made from */
+  if(aldl_gen_decode != NULL) {
+    if(aldl_gen_signature() != aldl_decode_signature(aldl)) {
+      error(0,ERROR_CONFIG,"generated decoder is for another definition file, "
+                           "not using it");
+      return;
+    }
+    decode_gen = aldl_gen_decode;
+    #ifdef DECODE_SELFTEST
+    if(decode_check(aldl,DECODE_SELFTEST_ROUNDS) == 0) {
+      error(0,ERROR_RANGE,"generated decoder failed self-check, not using it");
+      decode_gen = NULL;
+    }
+    #endif
+  }
+}
+
+char *decode_name() {
+  return decode_gen != NULL ? "generated" : decode_float_name;
+}
+
+unsigned long long decode_hash(unsigned long long h, void *p, size_t len) {
+  byte *b = p;
+  size_t x;
+  for(x=0;x<len;x++) {
+    h ^= b[x];
+    h *= 0x100000001b3ULL;
+  }
+  return h;
+}
+
+unsigned long long aldl_decode_signature(aldl_conf_t *aldl) {
+  unsigned long long h = 0xcbf29ce484222325ULL;
+  aldl_packetdef_t *pkt;
+  aldl_define_t *def;
+  int x, derived;
+  /* everything that changes what a packet decodes to, and nothing else.
+     fields are hashed one at a time, struct padding isn't defined. */
+  h = decode_hash(h,&aldl->minmax,sizeof(int));
+  h = decode_hash(h,&aldl->comm->byteorder,sizeof(aldl->comm->byteorder));
+  h = decode_hash(h,&aldl->comm->n_packets,sizeof(aldl->comm->n_packets));
+  h = decode_hash(h,&aldl->n_defs,sizeof(int));
+  for(x=0;x<aldl->comm->n_packets;x++) {
+    pkt = &aldl->comm->packet[x];
+    h = decode_hash(h,&pkt->offset,sizeof(pkt->offset));
+    h = decode_hash(h,&pkt->length,sizeof(pkt->length));
+  }
+  for(x=0;x<aldl->n_defs;x++) {
+    def = &aldl->def[x];
+    derived = ( def->expr != NULL ); /* if so, nothing else matters */
+    h = decode_hash(h,&derived,sizeof(int));
+    if(derived == 1) continue;
+    h = decode_hash(h,&def->type,sizeof(def->type));
+    h = decode_hash(h,&def->packet,sizeof(def->packet));
+    h = decode_hash(h,&def->offset,sizeof(def->offset));
+    h = decode_hash(h,&def->size,sizeof(def->size));
+    if(def->type == ALDL_BOOL) {
+      h = decode_hash(h,&def->binary,sizeof(def->binary));
+      h = decode_hash(h,&def->invert,sizeof(def->invert));
+      continue;
+    }
+    h = decode_hash(h,&def->multiplier,sizeof(aldl_data_t));
+    h = decode_hash(h,&def->adder,sizeof(aldl_data_t));
+    h = decode_hash(h,&def->min,sizeof(aldl_data_t));
+    h = decode_hash(h,&def->max,sizeof(aldl_data_t));
+    if(def->table != NULL) {
+      h = decode_hash(h,def->table,sizeof(aldl_data_t) * ALDL_TABLE_SIZE);
+    }
+  }
+  return h;
+}
+
+void decode_select_kernel() {
+  decode_float = decode_float_scalar;
+  decode_float_name = "scalar";
+  #ifdef DECODE_X86
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx2")) {
+    decode_float = decode_float_avx2;
+    decode_float_name = "avx2";
+  } else if(__builtin_cpu_supports("sse2")) {
+    decode_float = decode_float_sse2;
+    decode_float_name = "sse2";
+  }
+  #endif
+  #ifdef DECODE_NEON
+  decode_float = decode_float_neon;
+  decode_float_name = "neon";
+  #endif
+}
+
+inline int decode_field(byte *data, int offset, int wide) {
+  return wide == 1 ? ( data[offset] << 8 ) | data[offset + 1] : data[offset];
+}
+
+inline int decode_is_run(aldl_decodegroup_t *g, int first, int n) {
+  return g->out[first + n - 1] - g->out[first] == n - 1;
+}
+
+inline void decode_float_range(aldl_decodegroup_t *g, byte *data,
+                               aldl_data_t *out, int wide, int first) {
+  int i;
+  float f, r;
+  for(i=first;i<g->count;i++) {
+    f = ( (float)decode_field(data,g->offset[i],wide) * g->mul[i].f ) +
+        g->add[i].f;
+    r = f < g->min[i].f ? g->min[i].f : f;
+    r = f > g->max[i].f ? g->max[i].f : r;
+    out[g->out[i]].f = r;
+  }
+}
+
+void decode_float_scalar(aldl_decodegroup_t *g, byte *data, aldl_data_t *out,
+                         int wide) {
+  decode_float_range(g,data,out,wide,0);
+}
+
+#ifdef DECODE_X86
+__attribute__((target("sse2")))
+void decode_float_sse2(aldl_decodegroup_t *g, byte *data, aldl_data_t *out,
+                       int wide) {
+  float r[4];
+  int i, k;
+  int *o = g->offset;
+  float *mul = (float *)g->mul;
+  float *add = (float *)g->add;
+  float *min = (float *)g->min;
+  float *max = (float *)g->max;
+  __m128 v, lo, hi, m, c;
+  for(i=0;i + 4 <= g->count;i+=4) {
+    /* built in registers, a spill to memory and reload stalls here */
+    v = _mm_cvtepi32_ps(_mm_setr_epi32(decode_field(data,o[i],wide),
+                                       decode_field(data,o[i + 1],wide),
+                                       decode_field(data,o[i + 2],wide),
+                                       decode_field(data,o[i + 3],wide)));
+    v = _mm_mul_ps(v,_mm_loadu_ps(&mul[i]));
+    v = _mm_add_ps(v,_mm_loadu_ps(&add[i]));
+    lo = _mm_loadu_ps(&min[i]);
+    hi = _mm_loadu_ps(&max[i]);
+    m = _mm_cmplt_ps(v,lo);
+    c = _mm_or_ps(_mm_and_ps(m,lo),_mm_andnot_ps(m,v));
+    m = _mm_cmpgt_ps(v,hi);
+    c = _mm_or_ps(_mm_and_ps(m,hi),_mm_andnot_ps(m,c));
+    if(decode_is_run(g,i,4) == 1) {
+      _mm_storeu_ps(&out[g->out[i]].f,c);
+    } else {
+      _mm_storeu_ps(r,c);
+      for(k=0;k<4;k++) out[g->out[i + k]].f = r[k];
+    }
+  }
+  decode_float_range(g,data,out,wide,i);
+}
+
+__attribute__((target("avx2")))
+void decode_float_avx2(aldl_decodegroup_t *g, byte *data, aldl_data_t *out,
+                       int wide) {
+  float r[8];
+  int i, k;
+  float *mul = (float *)g->mul;
+  float *add = (float *)g->add;
+  float *min = (float *)g->min;
+  float *max = (float *)g->max;
+  __m256i x, idx;
+  __m256i byte0 = _mm256_set1_epi32(0xFF);
+  __m256 v, lo, hi, c;
+  for(i=0;i + 8 <= g->count;i+=8) {
+    /* gather a word at each offset, the packet buffer is padded so the
+       last field can be read this way, and keep the one or two bytes */
+    idx = _mm256_loadu_si256((__m256i *)&g->offset[i]);
+    x = _mm256_i32gather_epi32((int *)data,idx,1);
+    if(wide == 1) {
+      x = _mm256_or_si256(_mm256_slli_epi32(_mm256_and_si256(x,byte0),8),
+                          _mm256_and_si256(_mm256_srli_epi32(x,8),byte0));
+    } else {
+      x = _mm256_and_si256(x,byte0);
+    }
+    v = _mm256_cvtepi32_ps(x);
+    v = _mm256_mul_ps(v,_mm256_loadu_ps(&mul[i]));
+    v = _mm256_add_ps(v,_mm256_loadu_ps(&add[i]));
+    lo = _mm256_loadu_ps(&min[i]);
+    hi = _mm256_loadu_ps(&max[i]);
+    c = _mm256_blendv_ps(v,lo,_mm256_cmp_ps(v,lo,_CMP_LT_OQ));
+    c = _mm256_blendv_ps(c,hi,_mm256_cmp_ps(v,hi,_CMP_GT_OQ));
+    if(decode_is_run(g,i,8) == 1) {
+      _mm256_storeu_ps(&out[g->out[i]].f,c);
+    } else {
+      _mm256_storeu_ps(r,c);
+      for(k=0;k<8;k++) out[g->out[i + k]].f = r[k];
+    }
+  }
+  decode_float_range(g,data,out,wide,i);
+}
+#endif
+
+#ifdef DECODE_NEON
+void decode_float_neon(aldl_decodegroup_t *g, byte *data, aldl_data_t *out,
+                       int wide) {
+  float r[4];
+  int i, k;
+  int *o = g->offset;
+  float *mul = (float *)g->mul;
+  float *add = (float *)g->add;
+  float *min = (float *)g->min;
+  float *max = (float *)g->max;
+  int32x4_t x = vdupq_n_s32(0);
+  float32x4_t v, lo, hi, c;
+  for(i=0;i + 4 <= g->count;i+=4) {
+    x = vsetq_lane_s32(decode_field(data,o[i],wide),x,0);
+    x = vsetq_lane_s32(decode_field(data,o[i + 1],wide),x,1);
+    x = vsetq_lane_s32(decode_field(data,o[i + 2],wide),x,2);
+    x = vsetq_lane_s32(decode_field(data,o[i + 3],wide),x,3);
+    v = vcvtq_f32_s32(x);
+    v = vmulq_f32(v,vld1q_f32(&mul[i]));
+    v = vaddq_f32(v,vld1q_f32(&add[i]));
+    lo = vld1q_f32(&min[i]);
+    hi = vld1q_f32(&max[i]);
+    c = vbslq_f32(vcltq_f32(v,lo),lo,v);
+    c = vbslq_f32(vcgtq_f32(v,hi),hi,c);
+    if(decode_is_run(g,i,4) == 1) {
+      vst1q_f32(&out[g->out[i]].f,c);
+    } else {
+      vst1q_f32(r,c);
+      for(k=0;k<4;k++) out[g->out[i + k]].f = r[k];
+    }
+  }
+  decode_float_range(g,data,out,wide,i);
+}
+#endif
+
+void aldl_decode_packet(aldl_conf_t *aldl, int npkt, aldl_data_t *out,
+                        aldl_bits_t *bits) {
+  aldl_decode_raw(aldl,npkt,aldl->comm->packet[npkt].data,out,bits);
+}
+
+void aldl_decode_raw(aldl_conf_t *aldl, int npkt, byte *data,
+                     aldl_data_t *out, aldl_bits_t *bits) {
+  aldl_packetdef_t *pkt = &aldl->comm->packet[npkt];
+  aldl_decodegroup_t *g;
+  int i, n, r, in;
+  unsigned int x;
+
+  if(decode_gen != NULL) {
+    decode_gen(npkt,data,out,bits);
+    return;
+  }
+
+  /* each group is a plain loop with no per-definition branching; the clamp
+     compiles to conditional moves. */
+
+  g = &pkt->plan[ALDL_DECODE_INT8];
+  n = g->count;
+  for(i=0;i<n;i++) {
+    in = (int)data[g->offset[i]] * g->mul[i].i + g->add[i].i;
+    r = in < g->min[i].i ? g->min[i].i : in;
+    r = in > g->max[i].i ? g->max[i].i : r;
+    out[g->out[i]].i = r;
+  }
+
+  g = &pkt->plan[ALDL_DECODE_INT16];
+  n = g->count;
+  for(i=0;i<n;i++) {
+    x = ( data[g->offset[i]] << 8 ) | data[g->offset[i] + 1];
+    in = (int)x * g->mul[i].i + g->add[i].i;
+    r = in < g->min[i].i ? g->min[i].i : in;
+    r = in > g->max[i].i ? g->max[i].i : r;
+    out[g->out[i]].i = r;
+  }
+
+  decode_float(&pkt->plan[ALDL_DECODE_FLOAT8],data,out,0);
+  decode_float(&pkt->plan[ALDL_DECODE_FLOAT16],data,out,1);
+
+  /* one load each, whatever the type or curve */
+  g = &pkt->plan[ALDL_DECODE_TABLE8];
+  n = g->count;
+  for(i=0;i<n;i++) {
+    out[g->out[i]] = g->table[i * ALDL_TABLE_SIZE + data[g->offset[i]]];
+  }
+
+  aldl_decode_bits(aldl,npkt,data,bits);
+}
+
+void aldl_decode_bits(aldl_conf_t *aldl, int npkt, byte *data,
+                      aldl_bits_t *bits) {
+  aldl_packetdef_t *pkt = &aldl->comm->packet[npkt];
+  aldl_decodegroup_t *g;
+  int i, n;
+  unsigned int x;
+  aldl_bits_t b;
+
+  memset(bits,0,sizeof(aldl_bits_t) * ALDL_BITS_WORDS(pkt->n_bits));
+
+  g = &pkt->plan[ALDL_DECODE_BOOL8];
+  n = g->count;
+  for(i=0;i<n;i++) {
+    b = g->invert[i] ^ ( data[g->offset[i]] >> g->shift[i] & 1 );
+    bits[g->out[i] / ALDL_BITS_WORD] |= b << ( g->out[i] % ALDL_BITS_WORD );
+  }
+
+  g = &pkt->plan[ALDL_DECODE_BOOL16];
+  n = g->count;
+  for(i=0;i<n;i++) {
+    x = ( data[g->offset[i]] << 8 ) | data[g->offset[i] + 1];
+    b = g->invert[i] ^ ( x >> g->shift[i] & 1 );
+    bits[g->out[i] / ALDL_BITS_WORD] |= b << ( g->out[i] % ALDL_BITS_WORD );
+  }
+}
+
+aldl_data_t aldl_decode_def(aldl_conf_t *aldl, int n, byte *data) {
+  aldl_decodegroup_t *g = &aldl->comm->packet[aldl->def[n].packet].plan[
+                           defwhere[n].kind];
+  int i = defwhere[n].index;
+  int wide = 0;
+  aldl_data_t out;
+  unsigned int x;
+  int in;
+  float f;
+  switch(defwhere[n].kind) {
+    case ALDL_DECODE_INT16:
+      wide = 1; /* fall through */
+    case ALDL_DECODE_INT8:
+      in = (int)decode_field(data,g->offset[i],wide) * g->mul[i].i +
+           g->add[i].i;
+      out.i = in < g->min[i].i ? g->min[i].i : in;
+      out.i = in > g->max[i].i ? g->max[i].i : out.i;
+      break;
+    case ALDL_DECODE_FLOAT16:
+      wide = 1; /* fall through */
+    case ALDL_DECODE_FLOAT8:
+      f = ( (float)decode_field(data,g->offset[i],wide) * g->mul[i].f ) +
+          g->add[i].f;
+      out.f = f < g->min[i].f ? g->min[i].f : f;
+      out.f = f > g->max[i].f ? g->max[i].f : out.f;
+      break;
+    case ALDL_DECODE_TABLE8:
+      out = g->table[i * ALDL_TABLE_SIZE + data[g->offset[i]]];
+      break;
+    case ALDL_DECODE_BOOL16:
+      wide = 1; /* fall through */
+    default:
+      x = decode_field(data,g->offset[i],wide);
+      out.i = g->invert[i] ^ ( x >> g->shift[i] & 1 );
+  }
+  return out;
+}
+
+int decode_check(aldl_conf_t *aldl, int rounds) {
+  int npkt, x, round, ok = 1;
+  aldl_packetdef_t *pkt;
+  aldl_data_t *ref, *plan, *local;
+  aldl_bits_t *bits, b;
+  aldl_data_t one;
+  unsigned int seed = 1;
+  size_t datasize = sizeof(aldl_data_t) * aldl->n_defs;
+
+  ref = smalloc(datasize);
+  plan = smalloc(datasize);
+  local = smalloc(datasize); /* one packet's slots */
+  bits = smalloc(sizeof(aldl_bits_t) * ( ALDL_BITS_WORDS(aldl->n_defs) + 1 ));
+
+  for(round=0;round<rounds && ok == 1;round++) {
+    memset(ref,0,datasize);
+    memset(plan,0,datasize);
+    /* all zero and all ones first, those hit the clamps, then noise */
+    for(npkt=0;npkt<aldl->comm->n_packets;npkt++) {
+      pkt = &aldl->comm->packet[npkt];
+      for(x=0;x<pkt->length;x++) {
+        if(round == 0) {
+          pkt->data[x] = 0x00;
+        } else if(round == 1) {
+          pkt->data[x] = 0xFF;
+        } else {
+          pkt->data[x] = rand_r(&seed) % 256;
+        }
+      }
+    }
+    for(x=0;x<aldl->n_defs;x++) aldl_parse_def(aldl,ref,x);
+    for(npkt=0;npkt<aldl->comm->n_packets;npkt++) {
+      pkt = &aldl->comm->packet[npkt];
+      aldl_decode_packet(aldl,npkt,local,bits);
+      for(x=0;x<pkt->n_defs;x++) plan[pkt->defs[x]] = local[x];
+      for(x=0;x<pkt->n_bits;x++) {
+        b = bits[x / ALDL_BITS_WORD] >> ( x % ALDL_BITS_WORD ) & 1;
+        plan[pkt->bitdefs[x]].i = b;
+      }
+    }
+    /* one at a time, as raw records are read, must agree too */
+    for(x=0;x<aldl->n_defs;x++) {
+      if(aldl->def[x].expr != NULL) continue;
+      pkt = &aldl->comm->packet[aldl->def[x].packet];
+      one = aldl_decode_def(aldl,x,pkt->data);
+      if(memcmp(&one,&ref[x],sizeof(aldl_data_t)) != 0) {
+        error(0,ERROR_RANGE,"single decode mismatch in def %s",
+              aldl->def[x].name);
+        ok = 0;
+        break;
+      }
+    }
+    if(ok == 0) break;
+    if(memcmp(ref,plan,datasize) == 0) continue;
+    for(x=0;x<aldl->n_defs;x++) {
+      if(memcmp(&ref[x],&plan[x],sizeof(aldl_data_t)) != 0) {
+        error(0,ERROR_RANGE,"%s decode mismatch in def %s",
+              decode_name(),aldl->def[x].name);
+        break;
+      }
+    }
+    ok = 0;
+  }
+
+  /* leave nothing behind that looks like a received packet */
+  for(npkt=0;npkt<aldl->comm->n_packets;npkt++) {
+    pkt = &aldl->comm->packet[npkt];
+    memset(pkt->data,0,pkt->length);
+  }
+  free(ref);
+  free(plan);
+  free(local);
+  free(bits);
+  return ok;
+}
+
+unsigned long decode_time(aldl_conf_t *aldl, aldl_data_t *out,
+                          aldl_bits_t *bits) {
+  int npkt, n, pass;
+  unsigned long t, best = 0;
+  timespec_t timestamp;
+  for(pass=0;pass<DECODE_BENCH_PASSES;pass++) {
+    timestamp = get_time();
+    for(n=0;n<DECODE_BENCH_RECORDS / DECODE_BENCH_PASSES;n++) {
+      for(npkt=0;npkt<aldl->comm->n_packets;npkt++) {
+        aldl_decode_packet(aldl,npkt,out,bits);
+      }
+    }
+    t = get_elapsed_us(timestamp);
+    if(pass == 0 || t < best) best = t;
+  }
+  return best * DECODE_BENCH_PASSES;
+}
+
+void aldl_decode_bench(aldl_conf_t *aldl) {
+  int npkt, x, n;
+  aldl_packetdef_t *pkt;
+  aldl_data_t *ref, *local;
+  aldl_bits_t *bits;
+  timespec_t timestamp;
+  unsigned long t_ref, t_scalar, t_plan, t_gen = 0;
+  decode_float_fn selected = decode_float;
+  char *selected_name = decode_float_name;
+  void (*gen)(int, byte *, aldl_data_t *, aldl_bits_t *) = decode_gen;
+  size_t datasize = sizeof(aldl_data_t) * aldl->n_defs;
+
+  /* check every kernel agrees to the bit before timing anything */
+  decode_gen = NULL;
+  decode_float = decode_float_scalar;
+  decode_float_name = "scalar";
+  if(decode_check(aldl,DECODE_SELFTEST_ROUNDS) == 0) {
+    error(1,ERROR_RANGE,"scalar decode plan mismatch");
+  }
+  decode_float = selected;
+  decode_float_name = selected_name;
+  if(decode_check(aldl,DECODE_SELFTEST_ROUNDS) == 0) {
+    error(1,ERROR_RANGE,"%s decode plan mismatch",decode_float_name);
+  }
+  decode_gen = gen;
+  if(decode_gen != NULL && decode_check(aldl,DECODE_SELFTEST_ROUNDS) == 0) {
+    error(1,ERROR_RANGE,"generated decoder mismatch");
+  }
+
+  ref = smalloc(datasize);
+  local = smalloc(datasize);
+  memset(ref,0,datasize);
+  memset(local,0,datasize);
+  bits = smalloc(sizeof(aldl_bits_t) * ( ALDL_BITS_WORDS(aldl->n_defs) + 1 ));
+
+  /* random packet contents, the same for all decoders */
+  srand(1);
+  for(npkt=0;npkt<aldl->comm->n_packets;npkt++) {
+    pkt = &aldl->comm->packet[npkt];
+    for(x=0;x<pkt->length;x++) pkt->data[x] = rand() % 256;
+  }
+
+  timestamp = get_time();
+  for(n=0;n<DECODE_BENCH_RECORDS;n++) {
+    for(x=0;x<aldl->n_defs;x++) aldl_parse_def(aldl,ref,x);
+  }
+  t_ref = get_elapsed_us(timestamp);
+
+  decode_gen = NULL;
+  decode_float = decode_float_scalar;
+  t_scalar = decode_time(aldl,local,bits);
+  decode_float = selected;
+  t_plan = decode_time(aldl,local,bits);
+  decode_gen = gen;
+  if(decode_gen != NULL) t_gen = decode_time(aldl,local,bits);
+
+  printf("decoded %i records of %i defs\n",DECODE_BENCH_RECORDS,aldl->n_defs);
+  printf("aldl_parse_def: %.1f ns/record\n",
+         (float)t_ref * 1000 / DECODE_BENCH_RECORDS);
+  printf("plan, scalar:   %.1f ns/record (%.1fx)\n",
+         (float)t_scalar * 1000 / DECODE_BENCH_RECORDS,
+         t_scalar > 0 ? (float)t_ref / t_scalar : 0);
+  printf("plan, %s: %.1f ns/record (%.1fx)\n",decode_float_name,
+         (float)t_plan * 1000 / DECODE_BENCH_RECORDS,
+         t_plan > 0 ? (float)t_ref / t_plan : 0);
+  if(decode_gen != NULL) {
+    printf("generated:      %.1f ns/record (%.1fx)\n",
+           (float)t_gen * 1000 / DECODE_BENCH_RECORDS,
+           t_gen > 0 ? (float)t_ref / t_gen : 0);
+  } else if(aldl_gen_decode == NULL) {
+    printf("no generated decoder, see make GENDEF\n");
+  }
+  free(ref);
+  free(local);
+  free(bits);
+}
@@ -0,0 +1,378 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "error.h"
+#include "config.h"
+#include "aldl-io.h"
+#include "useful.h"
+
+/************ SCOPE *********************************
+  This object compiles derived channels, definitions
+  with an EXPR instead of a place in a packet, into
+  postfix code at load time, and runs that code once
+  for each record as it's created.  A derived channel
+  may also FILTER its value, updated once for each
+  new sample of its inputs.
+****************************************************/
+
+/* a node of the parse tree, which only lives until the code is emitted */
+typedef struct _expr_node {
+  aldl_exprop_t op;
+  float k;
+  int n;
+  struct _expr_node *a, *b; /* operands, b is NULL for unary */
+} expr_node_t;
+
+/* the state of parsing one expression */
+typedef struct _expr_parse {
+  aldl_conf_t *aldl;
+  int def;   /* the definition being compiled, for errors */
+  char *p;   /* the next character */
+} expr_parse_t;
+
+/* definition indexes of the derived channels, in the order they're run */
+int *exprdefs;
+
+/* when the newest input of each derived channel was received, as of the
+   record last evaluated */
+unsigned long *exprtime;
+
+/* ------ local functions ------------- */
+
+/* recursive descent, lowest precedence first.  each returns a folded tree.
+     sum     := product { ( + | - ) product }
+     product := unary { ( * | / ) unary }
+     unary   := - unary | + unary | primary
+     primary := number | channel name | ( sum )  */
+expr_node_t *expr_sum(expr_parse_t *s);
+expr_node_t *expr_product(expr_parse_t *s);
+expr_node_t *expr_unary(expr_parse_t *s);
+expr_node_t *expr_primary(expr_parse_t *s);
+
+/* make a node, replacing it with a constant if every operand is one, or
+   dropping a double negation */
+expr_node_t *expr_node(aldl_exprop_t op, expr_node_t *a, expr_node_t *b);
+
+/* the result of op on constants, the same arithmetic as aldl_expr_eval */
+float expr_apply(aldl_exprop_t op, float a, float b);
+
+/* skip spaces, then return the next character without taking it */
+char expr_peek(expr_parse_t *s);
+
+/* emit the postfix code for a tree into code at n, returning the new length.
+   depth is set to the stack depth the tree needs. */
+int expr_emit(expr_node_t *t, aldl_exprcode_t *code, int n, int *depth);
+
+/* run filter f over the value v of a sample taken at t, returning the
+   output.  returns the last output again if t isn't a new sample. */
+float expr_filter(aldl_filter_t *f, float v, unsigned long t);
+
+/* add a sample to a MEDIAN filter, returning the median */
+float expr_median(aldl_filter_t *f, float v);
+
+/* count the nodes of a tree, and free one */
+int expr_count(expr_node_t *t);
+void expr_free(expr_node_t *t);
+
+/* --------------------------------------------------------- */
+
+void aldl_expr_compile(aldl_conf_t *aldl) {
+  int x, pc, depth;
+  expr_parse_t s;
+  expr_node_t *t;
+  aldl_define_t *def;
+
+  exprdefs = smalloc(sizeof(int) * ( aldl->n_defs + 1 ));
+  exprtime = smalloc(sizeof(unsigned long) * ( aldl->n_defs + 1 ));
+  aldl->n_derived = 0;
+
+  for(x=0;x<aldl->n_defs;x++) {
+    def = &aldl->def[x];
+    if(def->expr == NULL) continue;
+
+    s.aldl = aldl;
+    s.def = x;
+    s.p = def->expr->src;
+    t = expr_sum(&s);
+    if(expr_peek(&s) != 0) error(1,ERROR_CONFIG,
+                          "unexpected %s in EXPR of def %s",s.p,def->name);
+
+    def->expr->code = smalloc(sizeof(aldl_exprcode_t) * expr_count(t));
+    def->expr->n_code = expr_emit(t,def->expr->code,0,&depth);
+    expr_free(t);
+    if(depth > EXPR_STACK) error(1,ERROR_CONFIG,
+                          "EXPR of def %s nests too deep",def->name);
+    if(def->filter != NULL) { /* it samples when a channel it uses does */
+      for(pc=0;pc<def->expr->n_code;pc++) {
+        if(def->expr->code[pc].op == ALDL_EXPR_FLOAT ||
+           def->expr->code[pc].op == ALDL_EXPR_INT) break;
+      }
+      if(pc == def->expr->n_code) error(1,ERROR_CONFIG,
+                          "nothing to FILTER in EXPR of def %s",def->name);
+    }
+
+    def->slot = aldl->n_derived;
+    exprdefs[aldl->n_derived] = x;
+    aldl->n_derived++;
+  }
+}
+
+void aldl_expr_eval(aldl_conf_t *aldl, aldl_record_t *rec) {
+  int x, pc, sp;
+  float stack[EXPR_STACK];
+  aldl_define_t *def, *in;
+  aldl_exprcode_t *c;
+  float r;
+  unsigned long t, tin;
+
+  /* in definition order, so a channel may use any derived one before it */
+  for(x=0;x<aldl->n_derived;x++) {
+    def = &aldl->def[exprdefs[x]];
+    sp = 0;
+    t = 0;
+    for(pc=0;pc<def->expr->n_code;pc++) {
+      c = &def->expr->code[pc];
+      switch(c->op) {
+        case ALDL_EXPR_CONST:
+          stack[sp++] = c->k;
+          break;
+        case ALDL_EXPR_FLOAT:
+        case ALDL_EXPR_INT:
+          if(c->op == ALDL_EXPR_FLOAT) {
+            stack[sp++] = record_float(aldl,rec,c->n);
+          } else {
+            stack[sp++] = (float)record_int(aldl,rec,c->n);
+          }
+          in = &aldl->def[c->n];
+          tin = in->expr != NULL ? exprtime[in->slot] : rec->pktt[in->packet];
+          if(tin > t) t = tin;
+          break;
+        case ALDL_EXPR_NEG:
+          stack[sp - 1] = -stack[sp - 1];
+          break;
+        default: /* binary */
+          sp--;
+          stack[sp - 1] = expr_apply(c->op,stack[sp - 1],stack[sp]);
+      }
+    }
+    r = stack[0];
+    exprtime[x] = t;
+    if(def->filter != NULL) r = expr_filter(def->filter,r,t);
+    if(def->type == ALDL_FLOAT) {
+      if(aldl->minmax == 1) r = rf_clamp_float(def->min.f,def->max.f,r);
+      rec->derived[def->slot].f = r;
+    } else {
+      rec->derived[def->slot].i = (int)( r < 0 ? r - 0.5 : r + 0.5 );
+      if(aldl->minmax == 1) {
+        rec->derived[def->slot].i = rf_clamp_int(def->min.i,def->max.i,
+                                                 rec->derived[def->slot].i);
+      }
+    }
+  }
+}
+
+float expr_filter(aldl_filter_t *f, float v, unsigned long t) {
+  float dt, step;
+  /* nothing new, or nothing received yet */
+  if(t == f->t) return f->out;
+  /* the clock goes back when it's reset near wraparound */
+  dt = t > f->t ? (float)( t - f->t ) : 0;
+  switch(f->type) {
+    case ALDL_FILTER_EMA:
+      f->out = f->n == 0 ? v : f->out + f->alpha * ( v - f->out );
+      break;
+    case ALDL_FILTER_MEDIAN:
+      f->out = expr_median(f,v);
+      break;
+    case ALDL_FILTER_SLEW:
+      step = f->slew * dt / 1000;
+      if(f->n == 0) {
+        f->out = v;
+      } else if(v > f->out + step) {
+        f->out += step;
+      } else if(v < f->out - step) {
+        f->out -= step;
+      } else {
+        f->out = v;
+      }
+      break;
+    case ALDL_FILTER_RATE: /* zero until there are two samples */
+      if(f->n > 0 && dt > 0) f->out = ( v - f->in ) * 1000 / dt;
+      break;
+  }
+  /* n stops at 1 for filters without a window */
+  if(f->n == 0 || f->n < f->window) f->n++;
+  f->in = v;
+  f->t = t;
+  return f->out;
+}
+
+float expr_median(aldl_filter_t *f, float v) {
+  int i, n = f->n;
+  if(n == f->window) { /* full, the oldest sample leaves */
+    for(i=0;i<n - 1 && f->sorted[i] != f->hist[f->pos];i++);
+    for(;i<n - 1;i++) f->sorted[i] = f->sorted[i + 1];
+    n--;
+  }
+  f->hist[f->pos] = v;
+  f->pos = ( f->pos + 1 ) % f->window;
+  for(i=n;i>0 && f->sorted[i - 1] > v;i--) f->sorted[i] = f->sorted[i - 1];
+  f->sorted[i] = v;
+  n++;
+  if(n % 2 == 1) return f->sorted[n / 2];
+  return ( f->sorted[n / 2 - 1] + f->sorted[n / 2] ) / 2;
+}
+
+float expr_apply(aldl_exprop_t op, float a, float b) {
+  switch(op) {
+    case ALDL_EXPR_ADD:
+      return a + b;
+    case ALDL_EXPR_SUB:
+      return a - b;
+    case ALDL_EXPR_MUL:
+      return a * b;
+    case ALDL_EXPR_DIV:
+      return b == 0 ? 0 : a / b;
+    case ALDL_EXPR_NEG:
+      return -a;
+    default:
+      error(1,ERROR_RANGE,"invalid expression op %i",op);
+  }
+  return 0; /* not reached */
+}
+
+expr_node_t *expr_node(aldl_exprop_t op, expr_node_t *a, expr_node_t *b) {
+  expr_node_t *t;
+  if(op == ALDL_EXPR_NEG && a->op == ALDL_EXPR_NEG) { /* - - x is x */
+    t = a->a;
+    free(a);
+    return t;
+  }
+  t = smalloc(sizeof(expr_node_t));
+  t->op = op;
+  t->k = 0;
+  t->n = 0;
+  t->a = a;
+  t->b = b;
+  /* constant folding */
+  if(a != NULL && a->op == ALDL_EXPR_CONST &&
+     ( b == NULL || b->op == ALDL_EXPR_CONST )) {
+    t->k = expr_apply(op,a->k,b != NULL ? b->k : 0);
+    t->op = ALDL_EXPR_CONST;
+    expr_free(a);
+    expr_free(b);
+    t->a = NULL;
+    t->b = NULL;
+  }
+  return t;
+}
+
+char expr_peek(expr_parse_t *s) {
+  while(*s->p == ' ' || *s->p == '\t') s->p++;
+  return *s->p;
+}
+
+expr_node_t *expr_sum(expr_parse_t *s) {
+  expr_node_t *t = expr_product(s);
+  char c;
+  while((c = expr_peek(s)) == '+' || c == '-') {
+    s->p++;
+    t = expr_node(c == '+' ? ALDL_EXPR_ADD : ALDL_EXPR_SUB,t,
+                  expr_product(s));
+  }
+  return t;
+}
+
+expr_node_t *expr_product(expr_parse_t *s) {
+  expr_node_t *t = expr_unary(s);
+  char c;
+  while((c = expr_peek(s)) == '*' || c == '/') {
+    s->p++;
+    t = expr_node(c == '*' ? ALDL_EXPR_MUL : ALDL_EXPR_DIV,t,expr_unary(s));
+  }
+  return t;
+}
+
+expr_node_t *expr_unary(expr_parse_t *s) {
+  char c = expr_peek(s);
+  if(c == '-') {
+    s->p++;
+    return expr_node(ALDL_EXPR_NEG,expr_unary(s),NULL);
+  }
+  if(c == '+') {
+    s->p++;
+    return expr_unary(s);
+  }
+  return expr_primary(s);
+}
+
+expr_node_t *expr_primary(expr_parse_t *s) {
+  aldl_conf_t *aldl = s->aldl;
+  char *name = aldl->def[s->def].name;
+  char word[64];
+  char *end;
+  int len = 0;
+  int n;
+  expr_node_t *t;
+
+  if(expr_peek(s) == '(') {
+    s->p++;
+    t = expr_sum(s);
+    if(expr_peek(s) != ')') error(1,ERROR_CONFIG,
+                               "missing ) in EXPR of def %s",name);
+    s->p++;
+    return t;
+  }
+
+  /* a word runs to the next space, operator or bracket */
+  while(s->p[len] != 0 && strchr(" \t+-*/()",s->p[len]) == NULL) len++;
+  if(len == 0) error(1,ERROR_CONFIG,"missing value in EXPR of def %s",name);
+  if(len >= (int)sizeof(word)) error(1,ERROR_CONFIG,
+                                  "name too long in EXPR of def %s",name);
+  memcpy(word,s->p,len);
+  word[len] = 0;
+  s->p += len;
+
+  t = expr_node(ALDL_EXPR_CONST,NULL,NULL);
+
+  /* anything that reads as a number is one */
+  t->k = strtof(word,&end);
+  if(*end == 0) return t;
+
+  n = get_index_by_name(aldl,word);
+  if(n == -1) error(1,ERROR_CONFIG,"unknown channel %s in EXPR of def %s",
+                    word,name);
+  if(aldl->def[n].expr != NULL && n >= s->def) error(1,ERROR_CONFIG,
+           "def %s uses derived channel %s, which must come before it",
+           name,word);
+  t->op = aldl->def[n].type == ALDL_FLOAT ? ALDL_EXPR_FLOAT : ALDL_EXPR_INT;
+  t->n = n;
+  return t;
+}
+
+int expr_emit(expr_node_t *t, aldl_exprcode_t *code, int n, int *depth) {
+  int da = 0, db = 0;
+  if(t->a != NULL) n = expr_emit(t->a,code,n,&da);
+  if(t->b != NULL) n = expr_emit(t->b,code,n,&db);
+  /* b is evaluated with a's result already on the stack */
+  *depth = t->a == NULL ? 1 : ( db + 1 > da ? db + 1 : da );
+  code[n].op = t->op;
+  code[n].k = t->k;
+  code[n].n = t->n;
+  return n + 1;
+}
+
+int expr_count(expr_node_t *t) {
+  if(t == NULL) return 0;
+  return 1 + expr_count(t->a) + expr_count(t->b);
+}
+
+void expr_free(expr_node_t *t) {
+  if(t == NULL) return;
+  expr_free(t->a);
+  expr_free(t->b);
+  free(t);
+}
@@ -0,0 +1,181 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "error.h"
+#include "config.h"
+#include "aldl-io.h"
+#include "useful.h"
+
+/************ SCOPE *********************************
+  This object keeps running statistics of channels
+  with STATS set, over each of the STATS_WINDOWS
+  lengths.  Each record gets the min, max, mean and
+  variance of the last few records as it's created,
+  at a cost that doesn't depend on the window, so
+  nothing ever has to walk back through the history.
+****************************************************/
+
+/* the running state of one channel over one window.  sample i of the
+   channel is kept in ring[i % len] until it leaves the window. */
+typedef struct _window {
+  int len;             /* the window length, in records */
+  int n;               /* samples in the window, up to len */
+  unsigned long count; /* samples ever taken */
+  float *ring;
+  double sum, sumsq;   /* of the samples in the window */
+  /* monotonic deques of sample numbers, circular with room for len.  the
+     values of minq rise from the head and those of maxq fall, so the head
+     of each is the min or max of the window. */
+  unsigned long *minq, *maxq;
+  int minhead, minsize, maxhead, maxsize;
+} window_t;
+
+/* state of every tracked channel and window, channel major */
+window_t *windows;
+
+/* definition indexes of the tracked channels */
+int *statsdefs;
+
+/* index of each definition among the tracked channels, or -1 */
+int *statsslot;
+
+/* ------ local functions ------------- */
+
+/* add a sample to a window, and write the statistics of it to out */
+void window_add(window_t *w, float v, aldl_aggregate_t *out);
+
+/* drop the front of a deque if that sample has left the window */
+void window_expire(window_t *w, unsigned long *q, int *head, int *size);
+
+/* push sample i onto the back of a deque, first popping every sample it
+   replaces as the min (max is 0) or max (max is 1) */
+void window_push(window_t *w, unsigned long *q, int head, int *size,
+                 unsigned long i, float v, int max);
+
+/* --------------------------------------------------------- */
+
+void aldl_window_init(aldl_conf_t *aldl) {
+  int x;
+  window_t *w;
+
+  statsdefs = smalloc(sizeof(int) * ( aldl->n_defs + 1 ));
+  statsslot = smalloc(sizeof(int) * ( aldl->n_defs + 1 ));
+  aldl->n_stats = 0;
+  for(x=0;x<aldl->n_defs;x++) {
+    statsslot[x] = -1;
+    if(aldl->def[x].stats == 0) continue;
+    statsslot[x] = aldl->n_stats;
+    statsdefs[aldl->n_stats] = x;
+    aldl->n_stats++;
+  }
+
+  windows = smalloc(sizeof(window_t) *
+                    ( aldl->n_stats * aldl->n_windows + 1 ));
+  for(x=0;x<aldl->n_stats * aldl->n_windows;x++) {
+    w = &windows[x];
+    memset(w,0,sizeof(window_t));
+    w->len = aldl->window[x % aldl->n_windows];
+    w->ring = smalloc(sizeof(float) * w->len);
+    w->minq = smalloc(sizeof(unsigned long) * w->len);
+    w->maxq = smalloc(sizeof(unsigned long) * w->len);
+  }
+
+  #ifdef DEBUGMEM
+  printf("window_t storage: %i bytes\n",
+         (int)sizeof(window_t) * aldl->n_stats * aldl->n_windows);
+  #endif
+}
+
+void aldl_window_update(aldl_conf_t *aldl, aldl_record_t *rec) {
+  int x, y;
+  aldl_define_t *def;
+  float v;
+  for(x=0;x<aldl->n_stats;x++) {
+    def = &aldl->def[statsdefs[x]];
+    if(def->type == ALDL_FLOAT) {
+      v = record_float(aldl,rec,statsdefs[x]);
+    } else {
+      v = (float)record_int(aldl,rec,statsdefs[x]);
+    }
+    for(y=0;y<aldl->n_windows;y++) {
+      window_add(&windows[x * aldl->n_windows + y],v,
+                 &rec->agg[x * aldl->n_windows + y]);
+    }
+  }
+}
+
+int record_window(aldl_conf_t *aldl, aldl_record_t *rec, int n, int len,
+                  aldl_aggregate_t *out) {
+  int y;
+  if(n < 0 || n > aldl->n_defs - 1 || statsslot[n] == -1) return -1;
+  for(y=0;y<aldl->n_windows;y++) {
+    if(aldl->window[y] != len) continue;
+    *out = rec->agg[statsslot[n] * aldl->n_windows + y];
+    return 0;
+  }
+  return -1;
+}
+
+void window_add(window_t *w, float v, aldl_aggregate_t *out) {
+  unsigned long i = w->count;
+  int x;
+  double mean, var;
+
+  /* the oldest sample leaves a full window, its slot is reused */
+  if(w->n == w->len) {
+    w->sum -= w->ring[i % w->len];
+    w->sumsq -= (double)w->ring[i % w->len] * w->ring[i % w->len];
+    window_expire(w,w->minq,&w->minhead,&w->minsize);
+    window_expire(w,w->maxq,&w->maxhead,&w->maxsize);
+  } else {
+    w->n++;
+  }
+  window_push(w,w->minq,w->minhead,&w->minsize,i,v,0);
+  window_push(w,w->maxq,w->maxhead,&w->maxsize,i,v,1);
+  w->ring[i % w->len] = v;
+  w->sum += v;
+  w->sumsq += (double)v * v;
+  w->count++;
+
+  /* the sums drift as samples come and go, add them up again once per
+     window, which costs one sample each time on average */
+  if(w->count % w->len == 0) {
+    w->sum = 0;
+    w->sumsq = 0;
+    for(x=0;x<w->n;x++) {
+      w->sum += w->ring[x];
+      w->sumsq += (double)w->ring[x] * w->ring[x];
+    }
+  }
+
+  mean = w->sum / w->n;
+  var = w->sumsq / w->n - mean * mean;
+  out->n = w->n;
+  out->min = w->ring[w->minq[w->minhead] % w->len];
+  out->max = w->ring[w->maxq[w->maxhead] % w->len];
+  out->mean = mean;
+  out->var = var < 0 ? 0 : var; /* rounding, when they're all the same */
+}
+
+void window_expire(window_t *w, unsigned long *q, int *head, int *size) {
+  /* only the sample a full len before the next one can be leaving */
+  if(*size > 0 && q[*head] + w->len <= w->count) {
+    *head = ( *head + 1 ) % w->len;
+    (*size)--;
+  }
+}
+
+void window_push(window_t *w, unsigned long *q, int head, int *size,
+                 unsigned long i, float v, int max) {
+  float back;
+  while(*size > 0) {
+    back = w->ring[q[( head + *size - 1 ) % w->len] % w->len];
+    if(max == 1 ? back > v : back < v) break;
+    (*size)--;
+  }
+  q[( head + *size ) % w->len] = i;
+  (*size)++;
+}
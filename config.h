@@ -73,8 +73,9 @@
    rate, at a higher risk of dropped packets and increased cpu usage */
 #undef AGGRESSIVE
 
-/* a static delay in microseconds.  used for waiting in between grabbing
-   serial chunks, and other throttling.  if AGGRESSIVE is defined, this is
+/* a static delay in microseconds, used for some throttling.  serial reads no
+   longer use this, they sleep in the driver until data arrives (see
+   serial_read_wait in serio.h).  if AGGRESSIVE is defined, this is
    generally ignored ... */
 #define SLEEPYTIME 200
 
@@ -86,6 +87,25 @@
    moved at the baud rate; generally 1 / baud * 1000 */
 #define SERIAL_BYTES_PER_MS 0.99
 
+/* learn each packet's real ecm turnaround and byte rate online, and set
+   receive deadlines from that instead of the worst case above.  a dropped
+   packet then costs a few ms instead of the full theoretical timeout. */
+#define ADAPTIVE_TIMEOUT
+
+/* good packets to learn from before the learned deadlines are trusted */
+#define ADAPTIVE_WARMUP 16
+
+/* weight of each new sample in the moving averages, 0-1 */
+#define ADAPTIVE_ALPHA 0.05
+
+/* learned deadlines are multiplied by this, then ADAPTIVE_SLACK ms added */
+#define ADAPTIVE_MARGIN 1.5
+#define ADAPTIVE_SLACK 3
+
+/* halve the lag histogram when it holds this many samples, so percentiles
+   follow the ecm if it changes behavior */
+#define ADAPTIVE_HISTDECAY 512
+
 /* defining this provides a linear decrease in the frequency of reconnect
    attempts.  this is for 'always-on' dashboard systems that might just sit
    there for hours at a time with no connection available.  this only works
@@ -120,9 +140,55 @@
 /* number of seconds to average retrieval rate.  reccommend at least 5. */
 #define PKTRATE_DURATION 5
 
+/* keep histograms of reply latency, retries per packet, byte rate and record
+   interval in the stats structure.  costs a few timestamps per packet. */
+#define STATS_HISTOGRAMS
+
+/* decode float channels with sse2/avx2 on x86 or neon on arm, picked at
+   runtime from what the cpu supports.  undefine for the scalar decoder. */
+#define DECODE_SIMD
+
+/* check the decoder against aldl_parse_def on random packets at startup, and
+   drop back to the scalar decoder if they differ in any bit. */
+#define DECODE_SELFTEST
+
+/* number of decoded values each segment caches when RAW_RECORDS is set.  a
+   direct mapped cache, so readers of the same few channels hit it. */
+#define RECORD_MEMO 8
+
+/* a packet that's byte for byte the same as the last one accepted isn't
+   decoded or stored again, the new record shares the old data.  spotted
+   in the checksum pass. */
+#define SKIP_REPEATS
+
+/* segments, which hold one reception of a packet, are allocated this many at
+   a time for each packet as more are needed. */
+#define SEGMENT_CHUNK 16
+
+/* the deepest a derived channel's expression may nest, in stack entries */
+#define EXPR_STACK 32
+
+/* the most samples a MEDIAN filter may take the median of */
+#define FILTER_MEDIAN_MAX 63
+
+/* the most window lengths STATS_WINDOWS may list */
+#define MAX_WINDOWS 4
+
+/* weight of each new sample in the per-packet scheduling stats, 0-1 */
+#define SCHED_ALPHA 0.1
+
+/* the longest the acq loop sleeps at once while no packet is due, in ms, so
+   waiting commands and state changes are seen quickly */
+#define ACQ_IDLE_SLICE 20
+
 /* extra check for bad message header.  checksum should be sufficient.. */
 #define CHECK_HEADER_SANITY
 
+/* when a packet fails its header or checksum test, try to realign to a real
+   frame further along in the received bytes and read its tail, before
+   falling back to a purge and a new request */
+#define FRAME_RESYNC
+
 /* track connection state for expiry of disable comms mode */
 #define LAGCHECK
 
@@ -131,11 +197,17 @@
    system; so the check should not be necessary ... and results are undefined */
 #define TIMESTAMP_WRAPAROUND
 
-/* when sending auxiliary commands such as EE MODE4 stuff, send the message
-   three times instead of one to help ensure success.  there's no real way to
-   tell if the command succeeded, so this is probably a good idea?
-   if commands are cumulative this is obviously broken, though. */
-#define AUXCOMMAND_RETRY
+/* auxiliary commands such as EE MODE4 stuff are checked against the ecm's
+   reply.  if it's missing or bad, resend this many more times before
+   reporting failure.  undefine to never resend. */
+#define AUXCOMMAND_RETRY 2
+
+/* number of slots in each aux command priority queue, must be a power of
+   two */
+#define AUXCOMMAND_QUEUESIZE 32
+
+/* number of keyed aux command slots, see aldl_post_command */
+#define AUXCOMMAND_KEYS 8
 
 /* ------- FTDI DRIVER CONFIG ------------------------*/
 
@@ -157,6 +229,17 @@
 #define FTDI_ATTEMPT_RECOVERY
 #define FTDI_MAXFAIL 3
 
+/* how long a read waits after the driver reports an error, in ms, before
+   giving up on that read.  a dead device fails every read at once, and
+   without this the wait for data would spin on it. */
+#define FTDI_ERROR_DELAY 10
+
+/* ------- TTY DRIVER CONFIG -------------------------*/
+
+/* how long a read waits after the port reports an error or hangup, in ms,
+   before giving up on that read, like FTDI_ERROR_DELAY. */
+#define TTY_ERROR_DELAY 10
+
 /* ------- DUMMY DRIVER CONFIG ----------------------*/
 
 /* simulate random corruption in dummy packets */
@@ -80,7 +80,7 @@ void cons_wait_for_connection();
 /* get a config string for a particular gauge */
 char *gconfig(char *parameter, int n);
 
-/* "smooth" a float */
+/* "smooth" a float over the last few records */
 float smooth_float(gauge_t *g);
 
 /* check if a value is past alarm range */
@@ -200,12 +200,11 @@ void print_centered_string(char *str) {
 }
 
 void draw_statusbar() {
-  lock_stats();
-  float pps = aldl->stats->packetspersecond;
-  unsigned int failcounter = aldl->stats->packetheaderfail +
-                            aldl->stats->packetchecksumfail +
-                            aldl->stats->packetrecvtimeout;
-  unlock_stats();
+  aldl_stats_t st;
+  aldl_get_stats(aldl,&st,NULL,NULL);
+  float pps = st.packetspersecond;
+  unsigned int failcounter = st.packetheaderfail + st.packetchecksumfail +
+                             st.packetrecvtimeout;
   if(w_width < 40) { /* small statusbar */
     mvprintw(w_height - 1,0,"%u R=%.1f ERR=%u  ",
              rec->t / 1000, pps, failcounter);
@@ -226,16 +225,15 @@ void statusmessage(char *str) {
 }
 
 void cons_wait_for_connection() {
-  aldl_state_t s = ALDL_LOADING;
-  aldl_state_t s_cache = ALDL_CONNECTED; /* cache to avoid redraws */
+  aldl_state_event_t ev;
+  unsigned long seq = get_state_event(aldl,&ev);
+  aldl_state_t s = get_connstate(aldl);
+  statusmessage(get_state_string(s)); /* disp. msg */
   while(s > 10) { /* messages >10 are non-connected */
-    s = get_connstate(aldl);
-    if(s != s_cache) { /* status message has changed */
-      statusmessage(get_state_string(s)); /* disp. msg */
-      s_cache = s; /* reset cache */
-    } else {
-      usleep(10000); /* checking conn state too fast is bad */
-    }
+    /* sleep until the state changes, only redraw when it does */
+    seq = wait_state_event(aldl,seq,&ev,0);
+    s = ev.state;
+    statusmessage(get_state_string(s));
   }
 
   statusmessage("Buffering...");
@@ -249,8 +247,7 @@ void cons_wait_for_connection() {
 void draw_bin(gauge_t *g) {
   aldl_define_t *def = &aldl->def[g->data_a];
   gauge_blank(g);
-  aldl_data_t *data = &rec->data[g->data_a];
-  if(data->i == 0) return;
+  if(record_int(aldl,rec,g->data_a) == 0) return;
   attron(COLOR_PAIR(GREEN_ON_BLACK));
   mvprintw(g->y,g->x,"%s",def->name);
   attroff(COLOR_PAIR(GREEN_ON_BLACK));
@@ -258,19 +255,16 @@ void draw_bin(gauge_t *g) {
 
 void draw_errstr(gauge_t *g) {
   int errfound = 0; 
-  int x = 0;
+  int x = -1;
   gauge_blank(g);
-  for(x=0;x<=aldl->n_defs - 1;x++) {
-    if(aldl->def[x].err == 1) { /* is an err flag */
-      if(rec->data[x].i == 1) { /* err flag is set */
-        if(errfound > 4) return; /* display max 4 codes */
-        attron(COLOR_PAIR(RED_ON_BLACK));
-        errfound++;
-        if(errfound == 1) mvprintw(g->y,g->x,"ERROR:");
-        printw(" %s",aldl->def[x].name);
-        attroff(COLOR_PAIR(RED_ON_BLACK));
-      }
-    }
+  /* only the set err flags are visited */
+  while((x = record_flag_next(aldl,rec,ALDL_FLAGS_ERR,x)) != -1) {
+    if(errfound > 4) return; /* display max 4 codes */
+    attron(COLOR_PAIR(RED_ON_BLACK));
+    errfound++;
+    if(errfound == 1) mvprintw(g->y,g->x,"ERROR:");
+    printw(" %s",aldl->def[x].name);
+    attroff(COLOR_PAIR(RED_ON_BLACK));
   }
   if(errfound == 0) mvprintw(g->y,g->x,"NO ERRORS");
 }
@@ -278,7 +272,6 @@ void draw_errstr(gauge_t *g) {
 void draw_simpletext_a(gauge_t *g) {
   aldl_define_t *def = &aldl->def[g->data_a];
   gauge_blank(g);
-  aldl_data_t *data = &rec->data[g->data_a];
   if(alarm_range(g) == 1) attron(COLOR_PAIR(RED_ON_BLACK));
   switch(def->type) {
     case ALDL_FLOAT:
@@ -291,7 +284,7 @@ void draw_simpletext_a(gauge_t *g) {
     case ALDL_INT:
     case ALDL_BOOL:
       mvprintw(g->y,g->x,"%s: %i",
-          def->name,data->i);
+          def->name,record_int(aldl,rec,g->data_a));
       #ifdef CONSOLEIF_UOM
       if(def->uom != NULL) printw(" %s",def->uom);
       #endif
@@ -304,7 +297,8 @@ void draw_simpletext_a(gauge_t *g) {
 
 int alarm_range(gauge_t *g) {
   aldl_define_t *def = &aldl->def[g->data_a];
-  aldl_data_t *data = &rec->data[g->data_a];
+  aldl_data_t value = record_get(aldl,rec,g->data_a);
+  aldl_data_t *data = &value;
   switch(def->type) {
     case ALDL_FLOAT:
       if( ( def->alarm_low_enable == 1 && data->f < def->alarm_low.f ) ||
@@ -327,7 +321,7 @@ void draw_h_progressbar(gauge_t *g) {
   switch(def->type) {
     case ALDL_INT:
     case ALDL_BOOL:
-      data = rec->data[g->data_a].i;
+      data = record_int(aldl,rec,g->data_a);
       data_lm = rf_clamp_int(g->bottom,g->top,data);
       break;
     case ALDL_FLOAT:
@@ -464,23 +458,28 @@ char *gconfig(char *parameter, int n) {
 }
 
 float smooth_float(gauge_t *g) {
-  if(g->smoothing == 0) return (rec->data[g->data_a].f +
-                              rec->data[g->data_b].f) / 2;
-  int x;
+  /* a FILTER channel is smoothed as it's acquired, so it's shown as is */
+  if(g->smoothing == 0 || ( aldl->def[g->data_a].filter != NULL &&
+                            aldl->def[g->data_b].filter != NULL )) {
+    return (record_float(aldl,rec,g->data_a) +
+            record_float(aldl,rec,g->data_b)) / 2;
+  }
+  int x, n = 0;
   aldl_record_t *r = rec;
+  aldl_record_t *p;
   float avg = 0;
   for(x=0;x<=g->smoothing;x++) {
-    avg += ( r->data[g->data_a].f + r->data[g->data_b].f ) / 2; 
-    if(r->prev == NULL) { /* attempt to trap underrun (might not work) */
-      error(1,ERROR_BUFFER,"buffer underrun caught in %s gauge\n\
-           %i smoothing w/ %i total buffer, and %i prebuffer.\n\
-            please decrease smoothing or increase prebuffer settings!!",
-         aldl->def[g->data_a].name,g->smoothing,aldl->bufsize,aldl->bufstart);
-    }
-    r = r->prev;
+    avg += ( record_float(aldl,r,g->data_a) +
+             record_float(aldl,r,g->data_b) ) / 2;
+    n++;
+    /* if older records are already overwritten, average the ones there are */
+    p = prev_record(r);
+    if(p == NULL) break;
+    r = p;
   }
-  avg += ( ( r->data[g->data_a].f + r->data[g->data_b].f ) / 2 ) * g->weight;
-  return avg / ( g->smoothing + g->weight + 1 );
+  avg += ( ( record_float(aldl,r,g->data_a) +
+              record_float(aldl,r,g->data_b) ) / 2 ) * g->weight;
+  return avg / ( n + g->weight );
 }
 
 void consoleif_exit() {
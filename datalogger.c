@@ -7,6 +7,7 @@
 
 /* local objects */
 #include "error.h"
+#include "config.h"
 #include "aldl-io.h"
 #include "loadconfig.h"
 #include "useful.h"
@@ -33,7 +34,7 @@ void *datalogger_init(void *aldl_in) {
   unsigned int n_records = 0; /* number of record counter */
   unsigned long last_timestamp = 0;
   int x = 0; /* tmp */
-  float pps; /* packet per second rate */
+  aldl_stats_t st; /* stats snapshot */
   aldl_conf_t *aldl = (aldl_conf_t *)aldl_in;
 
   /* grab config data */
@@ -54,6 +55,9 @@ void *datalogger_init(void *aldl_in) {
   char *linebuf = smalloc(linebufsize);
   char *cursor = linebuf; /* ptr to working byte in line buffer */
 
+  /* every logged value of a record, decoded at once */
+  aldl_data_t *values = smalloc(sizeof(aldl_data_t) * aldl->n_defs);
+
   /* this label is to be used for pausing and starting a new logfile in case
      one is required ... */
   //JUMP_ROLL_LOG:
@@ -81,7 +85,7 @@ void *datalogger_init(void *aldl_in) {
   cursor += sprintf(cursor,"\n");
   fwrite(linebuf,cursor - linebuf,1,conf->fdesc);
 
-  aldl_record_t *rec = aldl->r;
+  aldl_record_t *rec = newest_record(aldl);
   /* event loop */
   while(1) {
     if(conf->skip == 1) {
@@ -103,17 +107,18 @@ void *datalogger_init(void *aldl_in) {
     if(last_timestamp + conf->rate >= rec->t) continue; /* skip record */
     cursor=linebuf; /* reset cursor */
     cursor += sprintf(cursor,"%lu",rec->t);
+    record_decode(aldl,rec,values);
     for(x=0;x<aldl->n_defs;x++) {
       if(conf->log_all == 0) {
         if(aldl->def[x].log == 0) continue;
       }
       switch(aldl->def[x].type) {
         case ALDL_FLOAT:
-          cursor += sprintf(cursor,",%.2f",rec->data[x].f);
+          cursor += sprintf(cursor,",%.2f",values[x].f);
           break;
         case ALDL_INT:
         case ALDL_BOOL:
-          cursor += sprintf(cursor,",%i",rec->data[x].i);
+          cursor += sprintf(cursor,",%i",values[x].i);
           break;
         default:
           cursor += sprintf(cursor,",");
@@ -125,10 +130,23 @@ void *datalogger_init(void *aldl_in) {
     if(logger_be_quiet(aldl) == 0) {
       n_records++;
       if(n_records % 300 == 0) {
-        lock_stats();
-        pps = aldl->stats->packetspersecond;
-        unlock_stats();
-        printf("datalogger: Logged %u pkts @ %.2f/sec\n",n_records,pps);
+        aldl_get_stats(aldl,&st,NULL,NULL);
+        printf("datalogger: Logged %u pkts @ %.2f/sec (%.1f wakeups/pkt, \
+%.0fus wake latency)\n",n_records,st.packetspersecond,st.wakeupsperpacket,
+               st.wakelatency);
+        #ifdef STATS_HISTOGRAMS
+        printf("datalogger: reply %.1f/%.1fms p50/p99, %.2f retries/pkt, \
+%.0f bytes/sec\n",aldl_hist_percentile(&st.replylatency,50) / 1000,
+               aldl_hist_percentile(&st.replylatency,99) / 1000,
+               st.retries.count == 0 ? 0 : st.retries.sum / st.retries.count,
+               st.byterate.count == 0 ? 0 : st.byterate.sum /
+               st.byterate.count);
+        #endif
+        #ifdef SKIP_REPEATS
+        printf("datalogger: %.1f%% of packets repeated the last one\n",
+               st.packetaccepted == 0 ? 0 :
+               (float)st.packetrepeat * 100 / st.packetaccepted);
+        #endif
       }
     }
     last_timestamp = rec->t; /* update timestamp */
@@ -0,0 +1,188 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+
+/* local objects */
+#include "loadconfig.h"
+#include "config.h"
+#include "error.h"
+#include "aldl-io.h"
+#include "useful.h"
+
+/************ SCOPE *********************************
+  A build tool, not part of aldl-io.  Reads a
+  definition file and writes C source for a decoder
+  specialized to it, with every offset, constant and
+  clamp written in.  The runtime uses it instead of
+  the decode plan when the layout signature matches.
+
+  usage: gendecode <definition file> [minmax]
+****************************************************/
+
+/* ------ local functions ------------- */
+
+/* write the decoder for packet npkt */
+void gen_packet(aldl_conf_t *aldl, int npkt);
+
+/* write the table of clamped outputs of a definition with a TABLE */
+void gen_table(aldl_conf_t *aldl, int n);
+
+/* the raw field of def as an expression */
+char *gen_field(aldl_conf_t *aldl, aldl_define_t *def);
+
+/* print a float exactly, as a hex float literal */
+void gen_float(float f);
+
+/*---------- functions --------------------*/
+
+int main(int argc, char **argv) {
+  aldl_conf_t *aldl;
+  int x, minmax = 1;
+
+  if(argc < 2) {
+    fprintf(stderr,"usage: %s <definition file> [minmax]\n",argv[0]);
+    return 1;
+  }
+  if(argc > 2) minmax = atoi(argv[2]) == 0 ? 0 : 1;
+
+  aldl = aldl_setup_def(argv[1],minmax);
+  aldl_expr_compile(aldl); /* derived channels aren't decoded */
+  aldl_decode_compile(aldl); /* assigns slots and bits */
+
+  printf("/* generated by gendecode from %s, don't edit.\n"
+         "   make GENDEF=%s rebuilds it. */\n\n",argv[1],argv[1]);
+  printf("#include <string.h>\n#include <time.h>\n#include <pthread.h>\n\n");
+  printf("#include \"aldl-io.h\"\n\n");
+
+  printf("unsigned long long aldl_gen_signature() {\n");
+  printf("  return 0x%llxULL;\n}\n\n",aldl_decode_signature(aldl));
+
+  printf("/* set bool k of the packet, k is constant so this folds */\n");
+  printf("#define GEN_BIT(k,v) bits[(k) / ALDL_BITS_WORD] |= "
+         "(aldl_bits_t)(v) << ( (k) %% ALDL_BITS_WORD )\n\n");
+
+  for(x=0;x<aldl->n_defs;x++) {
+    if(aldl->def[x].table != NULL) gen_table(aldl,x);
+  }
+
+  for(x=0;x<aldl->comm->n_packets;x++) gen_packet(aldl,x);
+
+  printf("void aldl_gen_decode(int npkt, byte *data, aldl_data_t *out,\n"
+         "                     aldl_bits_t *bits) {\n");
+  printf("  switch(npkt) {\n");
+  for(x=0;x<aldl->comm->n_packets;x++) {
+    printf("    case %i:\n      gen_decode_%i(data,out,bits);\n      break;\n",
+           x,x);
+  }
+  printf("  }\n}\n");
+  return 0;
+}
+
+void gen_packet(aldl_conf_t *aldl, int npkt) {
+  aldl_packetdef_t *pkt = &aldl->comm->packet[npkt];
+  aldl_define_t *def;
+  int x, shift;
+  int ints = 0, floats = 0;
+
+  for(x=0;x<aldl->n_defs;x++) {
+    def = &aldl->def[x];
+    if(def->packet != npkt || def->table != NULL || def->expr != NULL) continue;
+    if(def->type == ALDL_INT) ints++;
+    if(def->type == ALDL_FLOAT) floats++;
+  }
+
+  printf("static void gen_decode_%i(byte *data, aldl_data_t *out, "
+         "aldl_bits_t *bits) {\n",npkt);
+  if(ints > 0) printf("  int i;\n");
+  if(floats > 0) printf("  float f;\n");
+  printf("  memset(bits,0,sizeof(aldl_bits_t) * ALDL_BITS_WORDS(%i));\n",
+         pkt->n_bits);
+
+  for(x=0;x<aldl->n_defs;x++) {
+    def = &aldl->def[x];
+    if(def->packet != npkt || def->expr != NULL) continue;
+    printf("  /* %s */\n",def->name);
+    if(def->type == ALDL_BOOL) {
+      shift = aldl->comm->byteorder == 1 ? 7 - def->binary : def->binary;
+      printf("  GEN_BIT(%i,( %s >> %i & 1 ) ^ %i);\n",def->slot,
+             gen_field(aldl,def),shift,def->invert);
+    } else if(def->table != NULL) {
+      printf("  out[%i] = gen_table_%i[%s];\n",def->slot,x,
+             gen_field(aldl,def));
+    } else if(def->type == ALDL_FLOAT) {
+      /* separate multiply and add, as aldl_parse_def, the makefile turns
+         off contraction */
+      printf("  f = ( (float)%s * ",gen_field(aldl,def));
+      gen_float(def->multiplier.f);
+      printf(" ) + ");
+      gen_float(def->adder.f);
+      printf(";\n");
+      if(aldl->minmax == 1) { /* in the order of rf_clamp_float */
+        printf("  out[%i].f = f > ",def->slot);
+        gen_float(def->max.f);
+        printf(" ? ");
+        gen_float(def->max.f);
+        printf(" : ( f < ");
+        gen_float(def->min.f);
+        printf(" ? ");
+        gen_float(def->min.f);
+        printf(" : f );\n");
+      } else {
+        printf("  out[%i].f = f;\n",def->slot);
+      }
+    } else {
+      printf("  i = ( (int)%s * %i ) + %i;\n",gen_field(aldl,def),
+             def->multiplier.i,def->adder.i);
+      if(aldl->minmax == 1) {
+        printf("  out[%i].i = i > %i ? %i : ( i < %i ? %i : i );\n",def->slot,
+               def->max.i,def->max.i,def->min.i,def->min.i);
+      } else {
+        printf("  out[%i].i = i;\n",def->slot);
+      }
+    }
+  }
+  printf("}\n\n");
+}
+
+void gen_table(aldl_conf_t *aldl, int n) {
+  aldl_define_t *def = &aldl->def[n];
+  int v;
+  float f;
+  int i;
+  printf("static const aldl_data_t gen_table_%i[%i] = {\n",n,ALDL_TABLE_SIZE);
+  for(v=0;v<ALDL_TABLE_SIZE;v++) {
+    if(def->type == ALDL_FLOAT) {
+      f = def->table[v].f;
+      if(aldl->minmax == 1) f = rf_clamp_float(def->min.f,def->max.f,f);
+      printf("  { .f = ");
+      gen_float(f);
+      printf(" },\n");
+    } else {
+      i = def->table[v].i;
+      if(aldl->minmax == 1) i = rf_clamp_int(def->min.i,def->max.i,i);
+      printf("  { .i = %i },\n",i);
+    }
+  }
+  printf("};\n\n");
+}
+
+char *gen_field(aldl_conf_t *aldl, aldl_define_t *def) {
+  static char buf[64];
+  int offset = def->offset + aldl->comm->packet[def->packet].offset;
+  if(def->size == 16) {
+    sprintf(buf,"( data[%i] << 8 | data[%i] )",offset,offset + 1);
+  } else { /* anything else is read as 8 bit */
+    sprintf(buf,"data[%i]",offset);
+  }
+  return buf;
+}
+
+void gen_float(float f) {
+  printf("%af",(double)f);
+}
+
+void main_exit() {
+  exit(1);
+}
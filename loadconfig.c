@@ -36,6 +36,17 @@ inline int is_whitespace(char ch);
 char *pktconfig(char *buf, char *parameter, int n);
 char *dconfig(char *buf, char *parameter, int n);
 
+/* build the lookup table of def x from a list of in:out breakpoints, such as
+   0:-40,128:50,255:150, interpolating between them and holding the ends */
+aldl_data_t *load_table(char *str, aldl_define_t *d, int x);
+
+/* the filter of def x, of the type named by str, and its options */
+aldl_filter_t *load_filter(dfile_t *config, char *str, int x);
+
+/* the statistics window lengths from a list of record counts, such as
+   10,100 */
+void load_windows(char *str);
+
 /* initial memory allocation routines */
 void aldl_alloc_a(); /* fixed structures */
 void aldl_alloc_b(); /* definition arrays */
@@ -46,6 +57,7 @@ void load_config_a(dfile_t *config); /* load data to alloc_a structures */
 void load_config_b(dfile_t *config); /* load data to alloc_b structures */
 void load_config_c(dfile_t *config);
 char *load_config_root(dfile_t *config); /* returns path to sub config */
+void load_definition(char *configfile); /* stages A to C */
 
 aldl_conf_t *aldl_setup() {
   /* load root config file ... */
@@ -64,8 +76,20 @@ aldl_conf_t *aldl_setup() {
 
   char *configfile = load_config_root(config);
 
+  load_definition(configfile);
+  return aldl;
+}
+
+aldl_conf_t *aldl_setup_def(char *configfile, int minmax) {
+  aldl_alloc_a();
+  aldl->minmax = minmax;
+  load_definition(configfile);
+  return aldl;
+}
+
+void load_definition(char *configfile) {
   /* load def config file ... */
-  config = dfile_load(configfile); /* re-use pointer */
+  dfile_t *config = dfile_load(configfile);
   if(config == NULL) error(1,ERROR_CONFIG,
                         "cant load definition file: %s",configfile);
   #ifdef DEBUGCONFIG
@@ -87,7 +111,6 @@ aldl_conf_t *aldl_setup() {
   #ifdef DEBUGCONFIG
   printf("configuration complete.\n");
   #endif
-  return aldl;
 }
 
 void aldl_alloc_a() {
@@ -121,11 +144,15 @@ void aldl_alloc_a() {
 
 char *load_config_root(dfile_t *config) {
   aldl->serialstr = configopt(config,"PORT",NULL);
-  aldl->bufsize = configopt_int(config,"BUFFER",10,10000,200);
+  aldl->bufsize = configopt_int(config,"BUFFER",10,200000,200);
   aldl->bufstart = configopt_int(config,"START",10,10000,aldl->bufsize / 2);
   aldl->minmax = configopt_int(config,"MINMAX",0,1,1);
+  aldl->lookup = configopt_int(config,"LOOKUP",0,1,1);
   aldl->maxfail = configopt_int(config,"MAXFAIL",1,1000,6);
   aldl->rate = configopt_int(config,"ACQRATE",0,100000,0);
+  aldl->incremental = configopt_int(config,"INCREMENTAL",0,1,0);
+  aldl->rawrecords = configopt_int(config,"RAW_RECORDS",0,1,0);
+  load_windows(configopt(config,"STATS_WINDOWS","10,100"));
   /* plugins */
   aldl->consoleif_enable = configopt_int(config,"CONSOLEIF_ENABLE",0,1,0);
   aldl->datalogger_enable = configopt_int(config,"DATALOGGER_ENABLE",0,1,0);
@@ -177,6 +204,13 @@ void load_config_b(dfile_t *config) {
                                                  "OFFSET",x),0,254,3);
     comm->packet[x].frequency = configopt_int(config,pktconfig(pktname,
                                                  "FREQUENCY",x),0,1000,1);
+    comm->packet[x].rate = configopt_float(config,pktconfig(pktname,
+                                                 "RATE",x),0);
+    if(comm->packet[x].rate < 0 || comm->packet[x].rate > 1000) {
+      error(1,ERROR_CONFIG,"P%i.RATE must be between 0 and 1000",x);
+    }
+    comm->packet[x].maxage = configopt_int(config,pktconfig(pktname,
+                                                 "MAXAGE",x),0,600000,0);
     generate_pktcommand(&comm->packet[x],comm);
     #ifdef DEBUGCONFIG
     printf("loaded packet %i\n",x);
@@ -189,15 +223,26 @@ void aldl_alloc_c() {
   /* storage for raw packet data */
   int x = 0;
   for(x=0;x<comm->n_packets;x++) {
-    comm->packet[x].data = smalloc(comm->packet[x].length);
+    comm->packet[x].data = smalloc(comm->packet[x].length + ALDL_DECODE_PAD);
     #ifdef DEBUGMEM
     printf("packet %i raw storage: %i bytes\n",x,comm->packet[x].length);
     #endif
     if(comm->packet[x].data == NULL) error(1,ERROR_MEMORY,"pkt data");
+    memset(comm->packet[x].data,0,comm->packet[x].length + ALDL_DECODE_PAD);
+    comm->packet[x].prev = smalloc(comm->packet[x].length);
+    memset(comm->packet[x].prev,0,comm->packet[x].length);
   }
 
+  /* storage for learned packet timing */
+  aldl->stats->timing = smalloc(sizeof(aldl_timing_t) * comm->n_packets);
+  memset(aldl->stats->timing,0,sizeof(aldl_timing_t) * comm->n_packets);
+  aldl->stats->sched = smalloc(sizeof(aldl_sched_t) * comm->n_packets);
+  memset(aldl->stats->sched,0,sizeof(aldl_sched_t) * comm->n_packets);
+
   /* storage for data definitions */
   aldl->def = smalloc(sizeof(aldl_define_t) * aldl->n_defs);
+  /* not every type sets every field (binary defs have no size) */
+  memset(aldl->def,0,sizeof(aldl_define_t) * aldl->n_defs);
   #ifdef DEBUGMEM
   printf("aldl_define_t definition storage: %i bytes\n",
               (int)sizeof(aldl_define_t) * aldl->n_defs);
@@ -214,8 +259,22 @@ void load_config_c(dfile_t *config) {
 
   for(x=0;x<aldl->n_defs;x++) {
     d = &aldl->def[x]; /* shortcut to def */
+    tmp=configopt(config,dconfig(configstr,"EXPR",x),NULL);
+    if(tmp != NULL) { /* derived, compiled later by aldl_expr_compile */
+      d->expr = smalloc(sizeof(aldl_expr_t));
+      memset(d->expr,0,sizeof(aldl_expr_t));
+      d->expr->src = tmp;
+    }
+    tmp=configopt(config,dconfig(configstr,"FILTER",x),NULL);
+    if(tmp != NULL) {
+      if(d->expr == NULL) error(1,ERROR_CONFIG,
+                    "FILTER needs an EXPR to filter in def %i",x);
+      d->filter = load_filter(config,tmp,x);
+    }
     tmp=configopt(config,dconfig(configstr,"TYPE",x),"FLOAT");
     if(rf_strcmp(tmp,"BINARY") == 1 || rf_strcmp(tmp,"ERROR") == 1) {
+      if(d->expr != NULL) error(1,ERROR_CONFIG,
+                             "derived def %i can't be %s",x,tmp);
       d->type=ALDL_BOOL;
       d->binary=configopt_int_fatal(config,dconfig(configstr,"BINARY",x),0,7);
       d->invert=configopt_int(config,dconfig(configstr,"INVERT",x),0,1,0);
@@ -255,12 +314,20 @@ void load_config_c(dfile_t *config) {
       }
       d->size=configopt_int(config,dconfig(configstr,"SIZE",x),1,32,8);     
       /* FIXME no support for signed input type */
+      tmp=configopt(config,dconfig(configstr,"TABLE",x),NULL);
+      if(tmp != NULL && d->expr == NULL) {
+        if(d->size == 16) error(1,ERROR_CONFIG,
+                              "TABLE needs an 8 bit input in def %i",x);
+        d->table = load_table(tmp,d,x);
+      }
     }
     d->alarm_low_enable=configopt_int(config,dconfig(configstr,
                         "ALARM_LOW_ENABLE",x),0,1,0);
     d->alarm_high_enable=configopt_int(config,dconfig(configstr,
                         "ALARM_HIGH_ENABLE",x),0,1,0);
-    d->offset=configopt_byte_fatal(config,dconfig(configstr,"OFFSET",x));
+    if(d->expr == NULL) {
+      d->offset=configopt_byte_fatal(config,dconfig(configstr,"OFFSET",x));
+    }
     d->packet=configopt_byte(config,dconfig(configstr,"PACKET",x),0x00);
     if(d->packet > comm->n_packets - 1) error(1,ERROR_CONFIG,
                         "packet %i out of range in def %i",d->packet,x);
@@ -278,6 +345,8 @@ void load_config_c(dfile_t *config) {
     d->description=configopt_fatal(config,dconfig(configstr,"DESC",x));
     d->log=configopt_int(config,dconfig(configstr,"LOG",x),0,1,0);
     d->display=configopt_int(config,dconfig(configstr,"DISPLAY",x),0,1,0);
+    d->stats=configopt_int(config,dconfig(configstr,"STATS",x),0,1,0);
+    d->history=configopt_int(config,dconfig(configstr,"HISTORY",x),0,1,0);
     #ifdef DEBUGCONFIG
     printf("loaded definition %i\n",x);
     #endif
@@ -285,6 +354,99 @@ void load_config_c(dfile_t *config) {
   free(configstr);
 }
 
+void load_windows(char *str) {
+  char *c = str;
+  char *end;
+  long len;
+  aldl->window = smalloc(sizeof(int) * MAX_WINDOWS);
+  aldl->n_windows = 0;
+  while(*c != 0) {
+    len = strtol(c,&end,10);
+    if(end == c || len < 1 || len > 100000) error(1,ERROR_CONFIG,
+                          "bad window length in STATS_WINDOWS at %s",c);
+    if(aldl->n_windows == MAX_WINDOWS) error(1,ERROR_CONFIG,
+                          "more than %i STATS_WINDOWS",MAX_WINDOWS);
+    aldl->window[aldl->n_windows] = len;
+    aldl->n_windows++;
+    c = end;
+    if(*c == ',') c++;
+  }
+}
+
+aldl_filter_t *load_filter(dfile_t *config, char *str, int x) {
+  char configstr[50];
+  aldl_filter_t *f = smalloc(sizeof(aldl_filter_t));
+  memset(f,0,sizeof(aldl_filter_t));
+  if(rf_strcmp(str,"EMA") == 1) {
+    f->type = ALDL_FILTER_EMA;
+    f->window = configopt_int(config,dconfig(configstr,"WINDOW",x),1,10000,8);
+    f->alpha = 2.0 / ( f->window + 1 );
+  } else if(rf_strcmp(str,"MEDIAN") == 1) {
+    f->type = ALDL_FILTER_MEDIAN;
+    f->window = configopt_int(config,dconfig(configstr,"WINDOW",x),
+                              1,FILTER_MEDIAN_MAX,5);
+    f->hist = smalloc(sizeof(float) * f->window);
+    f->sorted = smalloc(sizeof(float) * f->window);
+  } else if(rf_strcmp(str,"SLEW") == 1) {
+    f->type = ALDL_FILTER_SLEW;
+    f->slew = configopt_float_fatal(config,dconfig(configstr,"SLEW",x));
+    if(f->slew <= 0) error(1,ERROR_CONFIG,"SLEW must be over 0 in def %i",x);
+  } else if(rf_strcmp(str,"RATE") == 1) {
+    f->type = ALDL_FILTER_RATE;
+  } else {
+    error(1,ERROR_CONFIG,"invalid filter %s in def %i",str,x);
+  }
+  return f;
+}
+
+aldl_data_t *load_table(char *str, aldl_define_t *d, int x) {
+  int in[ALDL_TABLE_SIZE];
+  float out[ALDL_TABLE_SIZE];
+  int n = 0, k = 0, v;
+  char *c = str;
+  char *end;
+  float y;
+  aldl_data_t *table;
+
+  /* parse the breakpoints, inputs must rise */
+  while(*c != 0) {
+    if(n == ALDL_TABLE_SIZE) error(1,ERROR_CONFIG,
+                                 "too many TABLE points in def %i",x);
+    in[n] = strtol(c,&end,0);
+    if(end == c || *end != ':') error(1,ERROR_CONFIG,
+                                "bad TABLE point in def %i: %s",x,c);
+    c = end + 1;
+    out[n] = strtof(c,&end);
+    if(end == c || ( *end != ',' && *end != 0 )) error(1,ERROR_CONFIG,
+                                "bad TABLE point in def %i: %s",x,c);
+    if(in[n] < 0 || in[n] > ALDL_TABLE_SIZE - 1 ||
+       ( n > 0 && in[n] <= in[n - 1] )) error(1,ERROR_CONFIG,
+                  "TABLE inputs in def %i must rise from 0 to 255",x);
+    n++;
+    c = ( *end == ',' ) ? end + 1 : end;
+  }
+  if(n == 0) error(1,ERROR_CONFIG,"empty TABLE in def %i",x);
+
+  table = smalloc(sizeof(aldl_data_t) * ALDL_TABLE_SIZE);
+  for(v=0;v<ALDL_TABLE_SIZE;v++) {
+    while(k < n - 1 && in[k + 1] <= v) k++; /* last point at or below v */
+    if(v <= in[0]) {
+      y = out[0];
+    } else if(k == n - 1) {
+      y = out[n - 1];
+    } else {
+      y = out[k] + ( out[k + 1] - out[k] ) * (float)( v - in[k] ) /
+                   (float)( in[k + 1] - in[k] );
+    }
+    if(d->type == ALDL_FLOAT) {
+      table[v].f = y;
+    } else {
+      table[v].i = (int)( y < 0 ? y - 0.5 : y + 0.5 ); /* rounded */
+    }
+  }
+  return table;
+}
+
 char *configopt_fatal(dfile_t *config, char *str) {
   char *val = configopt(config,str,NULL);
   if(val == NULL) error(1,ERROR_CONFIG_MISSING,str);
@@ -24,6 +24,10 @@ typedef struct _dfile_t {
 /* configure all aldl structures and load config according to config file. */
 aldl_conf_t *aldl_setup();
 
+/* load only a definition file, for tools that don't run the acquisition.
+   minmax stands in for the root config's MINMAX. */
+aldl_conf_t *aldl_setup_def(char *configfile, int minmax);
+
 /* loads file, strips quotes, shrinks, parses in one step.. */
 dfile_t *dfile_load(char *filename);
 
@@ -50,6 +50,9 @@ void parse_cmdline(int argc, char **argv, aldl_conf_t *aldl);
 /* start acq thread */
 void acq_start(aldl_threads_t *thread, aldl_conf_t *aldl);
 
+/* set by the benchdecode option, run the decoder benchmark instead */
+int bench_decode = 0;
+
 /*---------- functions --------------------*/
 
 int main(int argc, char **argv) {
@@ -59,8 +62,12 @@ int main(int argc, char **argv) {
   aldl_sanity_check(aldl); /* sanity check the data from above */
   alloc_commbuf(); /* allocate communications static buffer */
   parse_cmdline(argc,argv,aldl); /* parse cmd line opts */
-  modules_verify(aldl); /* check for bad module combos */
+  if(bench_decode == 0) modules_verify(aldl); /* check module combos */
   aldl_data_init(aldl); /* init aldl data structs */
+  if(bench_decode == 1) { /* no serial or threads needed */
+    aldl_decode_bench(aldl);
+    exit(0);
+  }
   set_connstate(ALDL_LOADING,aldl); /* init connection state */
   serial_init(aldl->serialstr); /* init i/o driver */
 
@@ -92,6 +99,8 @@ void parse_cmdline(int argc, char **argv, aldl_conf_t *aldl) {
       aldl->datalogger_enable = 1;
     } else if(rf_strcmp(argv[n_arg],"remote") == 1) {
       aldl->remote_enable = 1;
+    } else if(rf_strcmp(argv[n_arg],"benchdecode") == 1) {
+      bench_decode = 1;
     } else {
       error(1,ERROR_NULL,"Option %s not recognized",argv[n_arg]);
     }
@@ -65,6 +65,9 @@ p_index_t p_idx;
 #define MODE4MINSPK -50
 #define MODE4MAXSPK 50
 
+/* aux command key for the mode 4 state, see aldl_post_command */
+#define M4_CMDKEY 0
+
 /* --- variables ---------------------------- */
 
 int w_height, w_width; /* width and height of window */
@@ -213,13 +216,13 @@ void *mode4_init(void *aldl_in) {
 }
 
 void get_engine_status() {
-  engine_status.rpm = rec->data[p_idx.rpm].f;
-  engine_status.idletarget = rec->data[p_idx.idletarget].f;
-  engine_status.iacsteps = rec->data[p_idx.iacsteps].i;
-  engine_status.cooltemp = rec->data[p_idx.cooltemp].f;
-  engine_status.map = rec->data[p_idx.map].f;
-  engine_status.adv = rec->data[p_idx.adv].i;
-  engine_status.kr = rec->data[p_idx.kr].f;
+  engine_status.rpm = record_float(aldl,rec,p_idx.rpm);
+  engine_status.idletarget = record_float(aldl,rec,p_idx.idletarget);
+  engine_status.iacsteps = record_int(aldl,rec,p_idx.iacsteps);
+  engine_status.cooltemp = record_float(aldl,rec,p_idx.cooltemp);
+  engine_status.map = record_float(aldl,rec,p_idx.map);
+  engine_status.adv = record_int(aldl,rec,p_idx.adv);
+  engine_status.kr = record_float(aldl,rec,p_idx.kr);
 }
 
 char *print_engine_status() {
@@ -277,16 +280,15 @@ void m4_statusmessage(char *str) {
 }
 
 void m4_cons_wait_for_connection() {
-  aldl_state_t s = ALDL_LOADING;
-  aldl_state_t s_cache = ALDL_CONNECTED; /* cache to avoid redraws */
+  aldl_state_event_t ev;
+  unsigned long seq = get_state_event(aldl,&ev);
+  aldl_state_t s = get_connstate(aldl);
+  m4_statusmessage(get_state_string(s)); /* disp. msg */
   while(s > 10) { /* messages >10 are non-connected */
-    s = get_connstate(aldl);
-    if(s != s_cache) { /* status message has changed */
-      m4_statusmessage(get_state_string(s)); /* disp. msg */
-      s_cache = s; /* reset cache */
-    } else {
-      usleep(10000); /* checking conn state too fast is bad */
-    }
+    /* sleep until the state changes, only redraw when it does */
+    seq = wait_state_event(aldl,seq,&ev,0);
+    s = ev.state;
+    m4_statusmessage(get_state_string(s));
   }
 
   m4_statusmessage("Buffering...");
@@ -454,7 +456,10 @@ void m4_comm_cancel() {
 
 void m4_comm_submit() {
   mfb[15] = checksum_generate(mfb,15); /* gen checksum @ last byte */
-  aldl_add_command(mfb, 16, 16); /* queue command, the acq thread sends it */
+  /* post command, the acq thread sends it and waits up to 100ms for the
+     ecm to acknowledge it.  it's the whole mode 4 state, so a newer one
+     replaces any that hasn't gone out yet. */
+  aldl_post_command(aldl, M4_CMDKEY, mfb, 16, 100, NULL);
 }
 
 void m4_init_status() {
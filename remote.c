@@ -14,10 +14,14 @@
 void *remote_init(void *aldl_in) {
   aldl_conf_t *aldl = aldl_in;
   int ran_connected_script = 0;
+  aldl_state_event_t ev;
+  unsigned long seq = get_state_event(aldl,&ev);
+  unsigned long newseq;
   while(1) {
 
-    /* loop throttling */
-    sleep(1);
+    /* loop throttling, but react to a state change right away */
+    newseq = wait_state_event(aldl,seq,&ev,1000);
+    if(newseq != 0) seq = newseq;
 
     /* exit entire program if this file is present ... */
     if(access("/etc/aldl/aldl-stop",F_OK) != -1) {
@@ -23,6 +23,10 @@
 
 unsigned char *databuff;
 char txmode;
+int datacursor; /* bytes of the current packet already sent */
+byte auxbuff[64]; /* echo and reply to an aux command */
+int auxlength; /* bytes in the above */
+int auxcursor; /* bytes of the above already sent */
 
 void gen_pkt();
 
@@ -60,6 +64,7 @@ int serial_init(char *port) {
   printf("Serial dummy driver initialized!\n");
   #endif
   txmode=0;
+  datacursor=0;
   databuff=malloc(64);
   return 1;
 }
@@ -94,6 +99,16 @@ int serial_write(byte *str, int len) {
   if(len == 4 && str[0] == 0xF4 && str[1] == 0x56 && \
      str[2] == 0x08 && str[3] == 0xAE) {
      txmode = 1;
+  } else if(len >= 3 && len <= 32 && str[2] == 0x04) {
+    /* mode 4 command, echo it then acknowledge with an empty mode 4 reply */
+    memcpy(auxbuff,str,len);
+    auxbuff[len] = str[0];
+    auxbuff[len + 1] = calc_msglength(4);
+    auxbuff[len + 2] = 0x04;
+    auxbuff[len + 3] = checksum_generate(auxbuff + len,3);
+    auxlength = len + 4;
+    auxcursor = 0;
+    txmode = 4;
   }
   return 0;
 }
@@ -133,22 +148,39 @@ inline int serial_read(byte *str, int len) {
     printhexstring(str,5);
     #endif
     return 5;
-  } if(txmode == 3) { /* data send */
+  } if(txmode == 3) { /* data send, may be read in pieces */
+    if(datacursor == 0) gen_pkt();
+    if(len > 64 - datacursor) len = 64 - datacursor;
     usleep(SERIAL_BYTES_PER_MS * len * 1000); /* fake baud delay */
-    txmode = 2;
-    gen_pkt();
     #ifdef SERIAL_VERBOSE
     printf("DUMMY MODE: Generated packet...\n");
     #endif
     int x;
     for(x=0;x<len;x++) {
-      str[x] = databuff[x]; 
+      str[x] = databuff[datacursor + x]; 
     }
+    datacursor += len;
+    if(datacursor == 64) { /* packet complete */
+      datacursor = 0;
+      txmode = 2;
+    }
+    return len;
+  } if(txmode == 4) { /* aux command echo and reply */
+    if(len > auxlength - auxcursor) len = auxlength - auxcursor;
+    usleep(SERIAL_BYTES_PER_MS * len * 1000); /* fake baud delay */
+    memcpy(str,auxbuff + auxcursor,len);
+    auxcursor += len;
+    if(auxcursor == auxlength) txmode = 2;
     return len;
   }
   return 0;
 }
 
+int serial_read_wait(byte *str, int len, int timeout) {
+  /* serial_read already blocks for the fake baud delay */
+  return serial_read(str,len);
+}
+
 void serial_help_devs() {
   error(1,ERROR_GENERAL,"this serial driver has no devices......");
 }
@@ -170,6 +170,26 @@ int serial_read(byte *str, int len) {
   return resp; /* return number of bytes read, or zero */
 }
 
+int serial_read_wait(byte *str, int len, int timeout) {
+  /* when the rx fifo is empty, ftdi_read_data blocks in the usb stack until
+     the chip's latency timer expires, so each pass here is one usb round trip
+     rather than a timed spin. */
+  timespec_t timestamp = get_time();
+  int resp = 0;
+  int remaining;
+  do {
+    resp = serial_read(str,len);
+    if(resp > 0) return resp;
+    if(resp < 0) { /* back off, the caller retries if it has time left */
+      remaining = timeout - (int)get_elapsed_ms(timestamp);
+      if(remaining > FTDI_ERROR_DELAY) remaining = FTDI_ERROR_DELAY;
+      if(remaining > 0) msleep(remaining);
+      return 0;
+    }
+  } while(get_elapsed_ms(timestamp) < timeout);
+  return 0;
+}
+
 inline void ftdifatal(int loc,int errno) {
   if(ftdierror(loc,errno) > 0) {
     error(1,ERROR_FTDI,"*** See above FTDI DRIVER error message @ stderr");
@@ -7,6 +7,7 @@
 #include <sys/stat.h>
 #include <sys/ioctl.h>
 #include <fcntl.h>
+#include <poll.h>
 
 #include <termios.h>
 
@@ -42,7 +43,7 @@ int serial_init(char *port) {
   #endif
 
   /* open serial port */
-  fd = open(port, O_RDWR | O_NOCTTY);
+  fd = open(port, O_RDWR | O_NOCTTY | O_NONBLOCK);
   if(fd < 0) { /* failed to open port */ 
     error(EFATAL,ERROR_SERIAL,"Couldn't open file descriptor for device %s",
           port);
@@ -74,8 +75,29 @@ int serial_write(byte *str, int len) {
 }
 
 int serial_read(byte *str, int len) {
-  /* read bytes into str */
-  return 0; /* return number of bytes read, or zero */
+  /* read bytes into str, port is nonblocking so this never waits */
+  int resp = read(fd,str,len);
+  if(resp < 0) return 0;
+  return resp; /* return number of bytes read, or zero */
+}
+
+int serial_read_wait(byte *str, int len, int timeout) {
+  /* sleep in poll() until the port is readable or we run out of time */
+  struct pollfd pfd;
+  int resp;
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+  pfd.revents = 0;
+  resp = poll(&pfd,1,timeout);
+  if(resp == 0) return 0; /* timeout */
+  if(resp > 0 && ( pfd.revents & POLLIN )) {
+    resp = serial_read(str,len);
+    if(resp > 0) return resp;
+  }
+  /* an error or hangup makes poll return at once every time, so back off
+     rather than letting the caller spin on it until its deadline */
+  if(timeout > 0) msleep(timeout < TTY_ERROR_DELAY ? timeout : TTY_ERROR_DELAY);
+  return 0;
 }
 
 void serial_help_devs() {
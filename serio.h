@@ -19,6 +19,11 @@ int serial_write(byte *str, int len);
    isn't there. */
 int serial_read(byte *str, int len);
 
+/* read data from the serial port to buf, like serial_read, but if nothing is
+   available, sleep in the driver until data arrives or timeout (in ms) has
+   expired.  returns number of bytes read, or zero on timeout.  never spins. */
+int serial_read_wait(byte *str, int len, int timeout);
+
 /* clears any i/o buffers */
 void serial_purge(); /* both buffers */
 void serial_purge_rx(); /* rx only */
@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <time.h>
+#include <string.h>
 
 #include "aldl-types.h"
 #include "useful.h"
@@ -32,6 +33,17 @@ unsigned long get_elapsed_ms(timespec_t timestamp) {
   return ( seconds * 1000 ) + milliseconds;
 }
 
+unsigned long get_elapsed_us(timespec_t timestamp) {
+  timespec_t currenttime = get_time();
+  unsigned long seconds = currenttime.tv_sec - timestamp.tv_sec;
+  #ifdef USEFUL_BETTERCLOCK
+  long microseconds = (currenttime.tv_nsec - timestamp.tv_nsec) / 1000;
+  #else
+  long microseconds = currenttime.tv_usec - timestamp.tv_usec;
+  #endif
+  return ( seconds * 1000000 ) + microseconds;
+}
+
 byte checksum_generate(byte *buf, int len) {
   #ifdef RETARDED
   retardptr(buf,"checksum buf");
@@ -50,6 +62,19 @@ int checksum_test(byte *buf, int len) {
   return 0;
 }
 
+int checksum_test_same(byte *buf, byte *prev, int len, int *same) {
+  int x = 0;
+  unsigned int sum = 0;
+  byte diff = 0;
+  for(x=0;x<len;x++) {
+    sum += buf[x];
+    diff |= buf[x] ^ prev[x];
+  }
+  *same = ( diff == 0 );
+  if(( sum & 0xFF ) == 0) return 1;
+  return 0;
+}
+
 int cmp_bytestring(byte *h, int hsize, byte *n, int nsize) {
   if(nsize > hsize) return 0; /* needle is larger than haystack */
   if(hsize < 1 || nsize < 1) return 0;
@@ -67,6 +92,14 @@ int cmp_bytestring(byte *h, int hsize, byte *n, int nsize) {
   return 0;
 }
 
+int find_bytestring(byte *h, int hsize, byte *n, int nsize) {
+  int cursor;
+  for(cursor=0;cursor<=hsize-nsize;cursor++) {
+    if(memcmp(h + cursor,n,nsize) == 0) return cursor + nsize;
+  }
+  return -1;
+}
+
 void printhexstring(byte *str, int length) {
   int x;
   for(x=0;x<length;x++) printf("%X ",(unsigned int)str[x]);
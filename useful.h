@@ -38,6 +38,9 @@ timespec_t get_time();
 /* get the difference between the current time and the timestamp */
 unsigned long get_elapsed_ms(timespec_t timestamp);
 
+/* same as above, in microseconds */
+unsigned long get_elapsed_us(timespec_t timestamp);
+
 /* convert a 0xFF format string to a 'byte'... */
 #define hextobyte(STR) (int)strtol(STR,NULL,16)
 
@@ -59,6 +62,10 @@ int checksum_test(byte *buf, int len);
 /* compare a byte string n(eedle) in h(aystack), nonzero if found */
 int cmp_bytestring(byte *h, int hsize, byte *n, int nsize);
 
+/* find a byte string n(eedle) in h(aystack), returns the position just after
+   the first match, or -1 if not found */
+int find_bytestring(byte *h, int hsize, byte *n, int nsize);
+
 /* print a string of bytes in hex format */
 void printhexstring(byte *str, int length);
 
@@ -86,6 +93,18 @@ int rf_chfilter(char *str, char *filter, char repl);
 int rf_clamp_int(int min, int max, int in);
 float rf_clamp_float(float min, float max, float in);
 
+/* --- ATOMICS ------------------------- */
+
+/* thin wrappers on gcc atomic builtins, for lock-free structures.  get has
+   acquire and set has release semantics, add is relaxed. */
+#define rf_atomic_get(P) __atomic_load_n(P,__ATOMIC_ACQUIRE)
+#define rf_atomic_set(P,V) __atomic_store_n(P,V,__ATOMIC_RELEASE)
+#define rf_atomic_add(P,V) __atomic_add_fetch(P,V,__ATOMIC_RELAXED)
+
+/* memory fences for seqlock style readers and writers */
+#define rf_fence_read() __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define rf_fence_write() __atomic_thread_fence(__ATOMIC_RELEASE)
+
 /* --- UNIX FILE I/O ------------------- */
 
 /* return a pointer to the entire contents of a file loaded into memory. if